@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+
+import sys
+import struct
+import argparse
+from elftools.elf.elffile import ELFFile
+from elftools.elf.constants import SH_FLAGS
+
+# keep in step with mem_phase_t in src/app/mem_arena.h
+PHASES = ["idle", "transfer", "patch", "copy"]
+
+
+def parse_region(text):
+    name, addr, size = text.split(":")
+    return name, int(addr, 0), int(size, 0)
+
+
+def find_symbol(elf, name):
+    for sym in elf.get_section_by_name(".symtab").iter_symbols():
+        if sym.name == name:
+            return sym
+    raise SystemExit(f"mem_report: symbol {name} not found")
+
+
+def read_symbol(elf, sym):
+    addr, size = sym["st_value"], sym["st_size"]
+    for section in elf.iter_sections():
+        start = section["sh_addr"]
+        if section["sh_type"] != "SHT_NOBITS" and start <= addr < start + section["sh_size"]:
+            return section.data()[addr - start:addr - start + size]
+    raise SystemExit(f"mem_report: no data for {sym.name}")
+
+
+def region_used(elf, base, size):
+    used = 0
+    for section in elf.iter_sections():
+        if not section["sh_flags"] & SH_FLAGS.SHF_ALLOC:
+            continue
+        if base <= section["sh_addr"] < base + size:
+            used += section["sh_size"]
+    return used
+
+
+def main():
+    parser = argparse.ArgumentParser(description="peak RAM per upgrade phase")
+    parser.add_argument("elf")
+    parser.add_argument("--region", action="append", type=parse_region, default=[],
+                        help="name:base:size of a RAM region")
+    args = parser.parse_args()
+
+    with open(args.elf, "rb") as f:
+        elf = ELFFile(f)
+        arena = find_symbol(elf, "mem_arena")
+        raw = read_symbol(elf, find_symbol(elf, "mem_arena_phase_size"))
+        phase_size = struct.unpack(f"<{len(raw) // 4}I", raw)
+        used = {name: (base, size, region_used(elf, base, size)) for name, base, size in args.region}
+
+    arena_addr, arena_size = arena["st_value"], arena["st_size"]
+    page = arena_size - max(phase_size)
+    over = False
+
+    print(f"mem_arena: {arena_size} bytes at 0x{arena_addr:08x}, page {page}")
+    for name, (base, size, total) in used.items():
+        holds_arena = base <= arena_addr < base + size
+        resident = total - arena_size if holds_arena else total
+        print(f"  {name:5s} {size:7d} bytes, resident {resident}")
+        if not holds_arena:
+            continue
+        for phase, extra in zip(PHASES, phase_size):
+            peak = resident + page + extra
+            over |= peak > size
+            print(f"    {phase:9s} region {extra:6d}  peak {peak:7d}  free {size - peak:7d}")
+
+    return 1 if over else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -14,6 +14,13 @@
 #if (_IS_RUN_MEM_SAFE_CHECK)
 #   define __RUN_MEM_SAFE_CHECK
 #endif
+#if (hpi_isNeedFastPatch)
+#   include <stdint.h>
+#   include <string.h> //memcpy
+#   if defined(__ARM_FEATURE_SIMD32) && (__ARM_FEATURE_SIMD32)
+#       include <arm_acle.h>
+#   endif
+#endif
 
 #define _CHECK(code)                { if (!(code)) return _hpi_FALSE; }
 
@@ -52,6 +59,18 @@ __cache_read_1byte:
 }
 
 static hpi_pos_t _cache_unpackUInt(_TInputCache* self,hpi_pos_t v,hpi_fast_uint8 isNext){
+#if (hpi_isNeedFastPatch)
+    {//decode straight from the cache buffer, the byte path below only runs across a refill
+        const hpi_byte* p=self->cache_buf+self->cache_begin;
+        const hpi_byte* const p_end=self->cache_buf+self->cache_end;
+        while (isNext&&(p<p_end)){
+            hpi_fast_uint8 b=*p++;
+            v=(v<<7)|(b&127);
+            isNext=b>>7;
+        }
+        self->cache_begin=(hpi_size_t)(p-self->cache_buf);
+    }
+#endif
     while (isNext){
         hpi_fast_uint8 b=_cache_read_1byte(self);
         v=(v<<7)|(b&127);
@@ -77,8 +96,26 @@ static hpi_BOOL _patch_copy_diff(hpatchi_listener_t* out_newData,
     return hpi_TRUE;
 }
 
+#if (hpi_isNeedFastPatch)
+#   if defined(__ARM_FEATURE_SIMD32) && (__ARM_FEATURE_SIMD32)
+#       define _hpi_add_u8x4(a,b)   __uadd8(a,b)    //UADD8, same as CMSIS __UADD8
+#   else //SWAR: add low 7 bits, then fix the high bit of every byte
+#       define _hpi_add_u8x4(a,b)   ((((a)&0x7F7F7F7FU)+((b)&0x7F7F7F7FU))^(((a)^(b))&0x80808080U))
+#   endif
     static hpi_force_inline void addData(hpi_byte* dst,const hpi_byte* src,hpi_size_t length){
+        while (length>=4){
+            uint32_t a,b;
+            memcpy(&a,dst,4);
+            memcpy(&b,src,4);
+            a=_hpi_add_u8x4(a,b);
+            memcpy(dst,&a,4);
+            dst+=4; src+=4; length-=4;
+        }
         while (length--) { *dst++ += *src++; } }
+#else
+    static hpi_force_inline void addData(hpi_byte* dst,const hpi_byte* src,hpi_size_t length){
+        while (length--) { *dst++ += *src++; } }
+#endif
 static hpi_BOOL _patch_add_old_withClip(hpatchi_listener_t* old_and_new,_TInputCache* diff,hpi_BOOL isNotNeedSubDiff,
                                         hpi_size_t oldPos,hpi_size_t addLength,hpi_byte* temp_cache){
     while (addLength>0){
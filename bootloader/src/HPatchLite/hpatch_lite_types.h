@@ -61,6 +61,11 @@ extern "C" {
 #endif
 
 
+#ifndef hpi_isNeedFastPatch //varint decode from the cache buffer & 4 bytes add in hpatch_lite_patch
+//output is byte-exact with hpi_isNeedFastPatch==0, costs some code size
+#   define hpi_isNeedFastPatch 0
+#endif
+
 #ifndef _IS_RUN_MEM_SAFE_CHECK 
 #   define _IS_RUN_MEM_SAFE_CHECK 1
 #endif
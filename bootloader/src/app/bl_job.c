@@ -0,0 +1,131 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+#include "bl_job.h"
+#include "mem_arena.h"
+
+LOG_MODULE_REGISTER(bl_job, CONFIG_LOG_DEFAULT_LEVEL);
+
+static K_SEM_DEFINE(job_sem, 0, 1);
+static struct k_spinlock job_lock;
+
+static bl_job_fn_t job_fn;
+static uint8_t job_arg[BL_JOB_ARG_SIZE] __aligned(4);
+static bl_job_status_t job;
+static uint32_t job_start_ms;
+static uint8_t job_pushed_percent;
+static uint8_t job_next_id;
+static bl_job_notify_t job_notify;
+
+static void job_push(void)
+{
+    bl_job_status_t status;
+
+    if (job_notify == NULL)
+        return;
+    bl_job_status(&status);
+    job_notify(&status);
+}
+
+int bl_job_submit(uint8_t opcode, bl_job_fn_t fn, const void *arg, size_t size, uint8_t *id)
+{
+    if (size > sizeof(job_arg))
+        return -EINVAL;
+
+    k_spinlock_key_t key = k_spin_lock(&job_lock);
+    if (job.state == BL_JOB_RUNNING) {
+        k_spin_unlock(&job_lock, key);
+        return -EBUSY;
+    }
+
+    if (++job_next_id == 0)
+        job_next_id = 1;
+    memset(&job, 0, sizeof(job));
+    job.id = job_next_id;
+    job.opcode = opcode;
+    job.state = BL_JOB_RUNNING;
+    job_fn = fn;
+    if (size)
+        memcpy(job_arg, arg, size);
+    job_start_ms = k_uptime_get_32();
+    job_pushed_percent = 0;
+    k_spin_unlock(&job_lock, key);
+
+    *id = job.id;
+    LOG_INF("job %u: opcode 0x%02x queued", job.id, opcode);
+    k_sem_give(&job_sem);
+    return 0;
+}
+
+bool bl_job_busy(void)
+{
+    return job.state == BL_JOB_RUNNING;
+}
+
+void bl_job_status(bl_job_status_t *status)
+{
+    k_spinlock_key_t key = k_spin_lock(&job_lock);
+    *status = job;
+    if (job.state == BL_JOB_RUNNING)
+        status->elapsed_ms = k_uptime_get_32() - job_start_ms;
+    k_spin_unlock(&job_lock, key);
+}
+
+void bl_job_notify_register(bl_job_notify_t notify)
+{
+    job_notify = notify;
+}
+
+void bl_job_progress(bl_job_phase_t phase, uint32_t done, uint32_t total)
+{
+    uint8_t percent = total ? (uint8_t)MIN((uint64_t)done * 100 / total, 100) : 0;
+    bool push;
+
+    k_spinlock_key_t key = k_spin_lock(&job_lock);
+    if (job.state != BL_JOB_RUNNING) {
+        k_spin_unlock(&job_lock, key);
+        return;
+    }
+    push = job.phase != phase || percent >= job_pushed_percent + CONFIG_BL_JOB_PUSH_STEP;
+    job.phase = phase;
+    job.percent = percent;
+    if (push)
+        job_pushed_percent = percent;
+    k_spin_unlock(&job_lock, key);
+
+    if (push)
+        job_push();
+}
+
+void bl_job_complete(int ret)
+{
+    // whatever phase the job left the arena in, request frames get it back
+    mem_arena_enter(MEM_PHASE_TRANSFER);
+
+    k_spinlock_key_t key = k_spin_lock(&job_lock);
+    job.result = ret;
+    job.state = ret == 0 ? BL_JOB_DONE : BL_JOB_FAILED;
+    if (ret == 0)
+        job.percent = 100;
+    job.elapsed_ms = k_uptime_get_32() - job_start_ms;
+    k_spin_unlock(&job_lock, key);
+
+    LOG_INF("job %u: %s, ret %d, %u ms", job.id, ret == 0 ? "done" : "failed", ret, job.elapsed_ms);
+    job_push();
+}
+
+static void job_thread(void *p1, void *p2, void *p3)
+{
+    while (1)
+    {
+        k_sem_take(&job_sem, K_FOREVER);
+
+        job_push();
+        int ret = job_fn(job_arg);
+        if (job.state == BL_JOB_RUNNING)
+            bl_job_complete(ret);
+    }
+}
+
+K_THREAD_DEFINE(job_thread_id, CONFIG_BL_JOB_STACK_SIZE, job_thread, NULL, NULL, NULL,
+                CONFIG_BL_JOB_PRIORITY, 0, 0);
@@ -0,0 +1,58 @@
+#ifndef __BL_JOB_H
+#define __BL_JOB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <zephyr/toolchain.h>
+
+#define BL_JOB_ARG_SIZE     16
+
+typedef enum
+{
+    BL_JOB_IDLE,                // no job since reset
+    BL_JOB_RUNNING,
+    BL_JOB_DONE,
+    BL_JOB_FAILED,
+} bl_job_state_t;
+
+typedef enum
+{
+    BL_JOB_PHASE_NONE,
+    BL_JOB_PHASE_ERASE,         // norflash or internal flash erase
+    BL_JOB_PHASE_PATCH,
+    BL_JOB_PHASE_COPY,          // image into internal flash
+    BL_JOB_PHASE_BACKUP,        // slot promotion
+    BL_JOB_PHASE_ARCHIVE,
+} bl_job_phase_t;
+
+/* JOB_STATUS response and JOB_NOTIFY push, percent is of the current phase */
+typedef struct __packed
+{
+    uint8_t id;
+    uint8_t opcode;             // request the job was started by
+    uint8_t state;
+    uint8_t phase;
+    uint8_t percent;
+    int32_t result;             // 0 or negative errno once done
+    uint32_t elapsed_ms;
+} bl_job_status_t;
+
+typedef int (*bl_job_fn_t)(void *arg);
+typedef void (*bl_job_notify_t)(const bl_job_status_t *status);
+
+/*
+ * One job runs at a time on the job worker, arg (up to BL_JOB_ARG_SIZE
+ * bytes) is copied. Returns -EBUSY while a job is running.
+ */
+int bl_job_submit(uint8_t opcode, bl_job_fn_t fn, const void *arg, size_t size, uint8_t *id);
+bool bl_job_busy(void);
+void bl_job_status(bl_job_status_t *status);
+/* phase change, percent steps and completion are pushed through notify */
+void bl_job_notify_register(bl_job_notify_t notify);
+/* called from the flash loops, ignored when no job is running */
+void bl_job_progress(bl_job_phase_t phase, uint32_t done, uint32_t total);
+/* for a job that does not return (boot jumps to the application), the worker calls it otherwise */
+void bl_job_complete(int ret);
+
+#endif
@@ -0,0 +1,88 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+#include "bl_stats.h"
+#include "bl_uart.h"
+#ifdef CONFIG_BL_PATCH_PIPELINE
+#include "patch_pipe.h"
+#endif
+
+LOG_MODULE_REGISTER(bl_stats, CONFIG_LOG_DEFAULT_LEVEL);
+
+extern const k_tid_t packet_thread_id;
+extern const k_tid_t one_data_thread_id;
+extern const k_tid_t sys_init_id;
+extern const k_tid_t job_thread_id;
+
+static bl_stats_t stats;
+
+uint32_t bl_stats_start(void)
+{
+    return k_cycle_get_32();
+}
+
+void bl_stats_stop(bl_stat_id_t id, uint32_t bytes, uint32_t start)
+{
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+    bl_stat_op_t *op = &stats.ops[id];
+    uint32_t bucket = 0;
+
+    while (bucket < BL_STATS_HIST_BUCKETS - 1 && us >= (16u << (2 * bucket)))
+        bucket++;
+
+    unsigned int key = irq_lock();
+    op->count++;
+    op->bytes += bytes;
+    op->total_us += us;
+    op->max_us = MAX(op->max_us, us);
+    if (op->hist[bucket] != UINT16_MAX)
+        op->hist[bucket]++;
+    irq_unlock(key);
+}
+
+void bl_stats_frame_error(void)
+{
+    stats.frame_crc_errors++;
+}
+
+static uint32_t stack_unused(k_tid_t tid)
+{
+    size_t unused = 0;
+
+#ifdef CONFIG_INIT_STACKS
+    k_thread_stack_space_get(tid, &unused);
+#endif
+    return unused;
+}
+
+void bl_stats_snapshot(bl_stats_t *out)
+{
+    bl_upgrade_rx_stats_get(&stats.rx_overruns, &stats.rx_high_water);
+    stats.stack_unused[BL_STACK_PACKET] = stack_unused(packet_thread_id);
+    stats.stack_unused[BL_STACK_UART_RX] = stack_unused(one_data_thread_id);
+    stats.stack_unused[BL_STACK_INIT] = stack_unused(sys_init_id);
+    stats.stack_unused[BL_STACK_JOB] = stack_unused(job_thread_id);
+#ifdef CONFIG_BL_PATCH_PIPELINE
+    stats.stack_unused[BL_STACK_PIPE_READ] = patch_pipe_stack_unused(PIPE_STAGE_READ);
+    stats.stack_unused[BL_STACK_PIPE_DECODE] = patch_pipe_stack_unused(PIPE_STAGE_DECODE);
+    stats.stack_unused[BL_STACK_PIPE_WRITE] = patch_pipe_stack_unused(PIPE_STAGE_WRITE);
+#endif
+
+    unsigned int key = irq_lock();
+    *out = stats;
+    irq_unlock(key);
+
+    out->version = BL_STATS_VERSION;
+    out->op_count = BL_STAT_COUNT;
+}
+
+void bl_stats_reset(void)
+{
+    unsigned int key = irq_lock();
+    memset(&stats, 0, sizeof(stats));
+    stats.since_ms = k_uptime_get_32();
+    irq_unlock(key);
+
+    bl_upgrade_rx_stats_reset();
+    LOG_INF("stats reset");
+}
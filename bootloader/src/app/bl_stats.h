@@ -0,0 +1,75 @@
+#ifndef __BL_STATS_H
+#define __BL_STATS_H
+
+#include <stdint.h>
+
+#define BL_STATS_VERSION        2
+#define BL_STATS_HIST_BUCKETS   8       // latency buckets: < 16us, < 64us, ... x4 each, last open ended
+
+typedef enum
+{
+    BL_STAT_OP_INQUIRY,         // opcode dispatch to response
+    BL_STAT_OP_QUERY,
+    BL_STAT_OP_PROGRAM,
+    BL_STAT_OP_ERASE,
+    BL_STAT_OP_VERIFY,
+    BL_STAT_OP_OTHER,
+    BL_STAT_NOR_READ,
+    BL_STAT_NOR_PROGRAM,
+    BL_STAT_NOR_ERASE,
+    BL_STAT_INT_ERASE,
+    BL_STAT_INT_PROGRAM,
+    BL_STAT_CRC,
+    BL_STAT_PATCH,              // diff patch into the diff slot, any path
+    BL_STAT_COPY,               // patched image to internal flash
+    BL_STAT_COUNT
+} bl_stat_id_t;
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t bytes;
+    uint32_t total_us;
+    uint32_t max_us;
+    uint16_t hist[BL_STATS_HIST_BUCKETS];
+} bl_stat_op_t;
+
+typedef enum
+{
+    BL_STACK_PACKET,
+    BL_STACK_UART_RX,
+    BL_STACK_INIT,
+    BL_STACK_JOB,               // erase, boot and rollback jobs
+    BL_STACK_PIPE_READ,         // patch pipeline stages, 0 until a pipelined patch ran
+    BL_STACK_PIPE_DECODE,
+    BL_STACK_PIPE_WRITE,
+    BL_STACK_COUNT
+} bl_stack_id_t;
+
+/* returned as is by the stats INQUIRY subcode */
+typedef struct
+{
+    uint16_t version;
+    uint8_t op_count;
+    uint8_t reserved;
+    uint32_t since_ms;          // uptime of the last reset of the counters
+    uint32_t frame_crc_errors;
+    uint32_t rx_overruns;
+    uint32_t rx_high_water;     // upgrade uart ring, bytes
+    uint32_t stack_unused[BL_STACK_COUNT];  // per bl_stack_id_t, bytes never touched
+    bl_stat_op_t ops[BL_STAT_COUNT];
+} bl_stats_t;
+
+#ifdef CONFIG_BL_STATS
+uint32_t bl_stats_start(void);
+void bl_stats_stop(bl_stat_id_t id, uint32_t bytes, uint32_t start);
+void bl_stats_frame_error(void);
+void bl_stats_snapshot(bl_stats_t *stats);
+void bl_stats_reset(void);
+#else
+static inline uint32_t bl_stats_start(void) { return 0; }
+static inline void bl_stats_stop(bl_stat_id_t id, uint32_t bytes, uint32_t start) { }
+static inline void bl_stats_frame_error(void) { }
+#endif
+
+#endif
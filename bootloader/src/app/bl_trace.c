@@ -0,0 +1,58 @@
+#include <zephyr/kernel.h>
+#include <string.h>
+#include "bl_trace.h"
+
+#define TRACE_RECORDS       CONFIG_BL_TRACE_RECORDS
+#define TRACE_MASK          (TRACE_RECORDS - 1)
+
+BUILD_ASSERT((TRACE_RECORDS & TRACE_MASK) == 0, "trace records must be a power of two");
+BUILD_ASSERT(sizeof(bl_trace_record_t) == 16, "trace record is part of the host protocol");
+
+static bl_trace_record_t ring[TRACE_RECORDS] __ccm_noinit_section;
+static uint32_t head;
+
+/* one record store, no formatting: cheap enough for every packet and flash page */
+void bl_trace(bl_trace_event_t event, uint16_t arg0, uint32_t arg1, uint32_t arg2)
+{
+    unsigned int key = irq_lock();
+    bl_trace_record_t *rec = &ring[head & TRACE_MASK];
+
+    rec->cycles = k_cycle_get_32();
+    rec->event = event;
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+    rec->arg2 = arg2;
+    head++;
+    irq_unlock(key);
+}
+
+/*
+ * Copies records from sequence seq on into buf behind a bl_trace_dump_t,
+ * a seq already overwritten starts at the oldest record still held.
+ * Returns the bytes used in buf.
+ */
+uint32_t bl_trace_read(uint32_t seq, uint8_t *buf, uint32_t size)
+{
+    bl_trace_dump_t *dump = (bl_trace_dump_t *)buf;
+    bl_trace_record_t *out = (bl_trace_record_t *)(buf + sizeof(*dump));
+    uint32_t room = (size - sizeof(*dump)) / sizeof(*out);
+
+    unsigned int key = irq_lock();
+    uint32_t next = head;
+    uint32_t oldest = next > TRACE_RECORDS ? next - TRACE_RECORDS : 0;
+
+    if (seq < oldest || seq > next)
+        seq = oldest;
+    uint32_t count = MIN(next - seq, room);
+    for (uint32_t i = 0; i < count; i++)
+        out[i] = ring[(seq + i) & TRACE_MASK];
+    irq_unlock(key);
+
+    dump->first_seq = seq;
+    dump->next_seq = next;
+    dump->cycles_per_sec = sys_clock_hw_cycles_per_sec();
+    dump->count = count;
+    dump->record_size = sizeof(*out);
+
+    return sizeof(*dump) + count * sizeof(*out);
+}
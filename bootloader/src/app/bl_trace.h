@@ -0,0 +1,49 @@
+#ifndef __BL_TRACE_H
+#define __BL_TRACE_H
+
+#include <stdint.h>
+
+/* ids are part of the host protocol, trace_decode.py keeps the same table */
+typedef enum
+{
+    BL_TRACE_PKT_DISPATCH = 1,  // opcode, length
+    BL_TRACE_PKT_RESPONSE,      // opcode, err, length
+    BL_TRACE_FRAME_CRC_ERR,     // opcode, received crc, computed crc
+    BL_TRACE_INT_PROGRAM,       // -, address, size
+    BL_TRACE_INT_ERASE,         // -, address, size
+    BL_TRACE_NOR_PROGRAM,       // -, slot offset, size
+    BL_TRACE_NOR_ERASE,         // -, device offset, size
+    BL_TRACE_RX_OVERRUN,        // -, bytes dropped
+    BL_TRACE_PATCH_BEGIN,       // compress type, new size
+    BL_TRACE_PATCH_END,         // ret, new size
+    BL_TRACE_COPY_CHECKPOINT,   // -, copied, size
+    BL_TRACE_JOURNAL,           // phase, progress
+} bl_trace_event_t;
+
+typedef struct
+{
+    uint32_t cycles;
+    uint16_t event;
+    uint16_t arg0;
+    uint32_t arg1;
+    uint32_t arg2;
+} bl_trace_record_t;
+
+/* TRACE_READ response header, records follow */
+typedef struct
+{
+    uint32_t first_seq;         // sequence of the first record returned
+    uint32_t next_seq;          // sequence the next record will get
+    uint32_t cycles_per_sec;
+    uint16_t count;
+    uint16_t record_size;
+} bl_trace_dump_t;
+
+#ifdef CONFIG_BL_TRACE
+void bl_trace(bl_trace_event_t event, uint16_t arg0, uint32_t arg1, uint32_t arg2);
+uint32_t bl_trace_read(uint32_t seq, uint8_t *buf, uint32_t size);
+#else
+static inline void bl_trace(bl_trace_event_t event, uint16_t arg0, uint32_t arg1, uint32_t arg2) { }
+#endif
+
+#endif
@@ -3,6 +3,15 @@
 #include <zephyr/devicetree.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/sys/crc.h>
+#ifdef CONFIG_BL_VERIFY_ONCE
+#include <zephyr/drivers/hwinfo.h>
+#endif
+#if defined(CONFIG_BL_VERIFY_ONCE) && defined(CONFIG_RETENTION)
+#include <zephyr/retention/retention.h>
+#endif
+#ifdef CONFIG_RETENTION_BOOT_MODE
+#include <zephyr/retention/bootmode.h>
+#endif
 #include "flash_area.h"
 #include "meta_desc.h"
 #include "bl_button.h"
@@ -11,12 +20,23 @@
 #include "bitos.h"
 #include "norflash.h"
 #include "hpatchlite.h"
+#include "nor_erase.h"
+#include "partition.h"
+#include "boot_timeline.h"
+#include "bl_stats.h"
+#include "bl_trace.h"
+#include "mem_arena.h"
+#include "bl_job.h"
+#ifdef CONFIG_BL_ARCHIVE_STORE
+#include "archive.h"
+#endif
 
 LOG_MODULE_REGISTER(boot, CONFIG_LOG_DEFAULT_LEVEL);
 
 #define BL_BOOT_MTU_SIZE         4096
 #define BL_MAX_TRANSFER_MTUSIZE  (BL_BOOT_MTU_SIZE + 8)
 #define BL_BOOT_VERSION          "v1.0.1"
+#define BL_CTRL_FRAME_SIZE       64      // every request but PROGRAM, parsed while a job owns the arena
 
 typedef enum
 {
@@ -25,7 +45,8 @@ typedef enum
     START,
     OPCODE,
     DATA,
-    VERIFY
+    VERIFY,
+    DISCARD                 // rest of a rejected frame, counted but not stored
 } bl_state_machine_t;
 
 typedef enum
@@ -34,19 +55,37 @@ typedef enum
     OPCODE_INQUIRY = 0x10,
     OPCODE_QUERY = 0x40,
     OPCODE_READ = 0x12,
+    OPCODE_TRACE_READ = 0x13,
+    OPCODE_JOB_STATUS = 0x14,
+    OPCODE_JOB_NOTIFY = 0x15,   // pushed by the device, never requested
     OPCODE_PROGRAM = 0x20,
     OPCODE_ERASE = 0x21,
     OPCODE_VERIFY = 0x22,
     OPCODE_RESET = 0x81,
     OPCODE_BOOT = 0x82,
+    OPCODE_ROLLBACK = 0x83,
     OPCODE_UNKNOWN = 0xFF
 } bl_opcode_t;
 
+/*
+ * Every request is answered, a failure at once with one of these. Responses
+ * with err other than OK carry a u32 detail as their data, its meaning is
+ * given per error.
+ */
 typedef enum
 {
     BL_ERR_OK = 0,
-    BL_ERR_OVERFLOW,
-    BL_ERR_UNKNOWN,
+    BL_ERR_OVERFLOW,            // frame longer than the receive buffer, detail: max data length
+    BL_ERR_UNKNOWN,             // unspecified, detail: 0
+    BL_ERR_BUSY,                // a job is running, retry once it is done, detail: 0
+    BL_ERR_BAD_CRC,             // frame crc16 mismatch, detail: crc16 computed by the device
+    BL_ERR_BAD_PARAM,           // data length does not fit the opcode, detail: expected length
+    BL_ERR_OUT_OF_RANGE,        // address outside the partitions or layout, detail: base address the device expects
+    BL_ERR_FLASH,               // flash erase or write faild, detail: negative errno
+    BL_ERR_VERIFY,              // crc32 mismatch, detail: crc32 computed by the device
+    BL_ERR_SEQ_GAP,             // PROGRAM address is not where the download stands, detail: expected address
+    BL_ERR_UNSUPPORTED,         // opcode or subcode not built in, detail: 0
+    BL_ERR_REFUSED,             // not allowed in this state, detail: 0
 } bl_response_err_t;
 
 typedef struct
@@ -56,13 +95,18 @@ typedef struct
     uint32_t length;
     uint32_t index;
     uint16_t crc;
-    uint8_t data[5112];
+    uint8_t *data;          // arena transfer region, or ctrl_frame while a job owns the arena
+    uint32_t size;
 } bl_ctrl_t;
 
 typedef enum
 {
     BL_INQUIRY_VERSION,
-    BL_INQUIRY_MTU_SIZE
+    BL_INQUIRY_MTU_SIZE,
+    BL_INQUIRY_DIRECT_INSTALL,
+    BL_INQUIRY_BOOT_TIMELINE,
+    BL_INQUIRY_STATS,
+    BL_INQUIRY_STATS_RESET
 } bl_inquiry_t;
 
 typedef struct
@@ -96,23 +140,57 @@ typedef struct
     uint32_t crc;
 } bl_verify_info_t;
 
+typedef struct
+{
+    uint32_t size;
+    uint32_t crc;
+} bl_rollback_info_t;
+
 static meta_desc_info_t meta_desc;
 static meta_desc_info_t *meta = &meta_desc;
 
+// direct install: PROGRAM frames of a full package go straight into the application
+// partition and are mirrored to the download slot, only allowed with a valid active backup
+static bool direct_install;
+static bool direct_app_erased;
+static uint32_t upgrade_start_ms;
+
+static boot_path_t jump_path = BOOT_PATH_DIRECT;
+// set once resume and recovery are over, the uart is already up while they run
+static bool session_open;
+
+// dispatch of the packet being handled, its first response closes the opcode latency
+static uint32_t op_start;
+static bool op_pending;
+
+// NAK of a frame the parser rejected, sent by the packet thread so the rx thread keeps draining the ring
+static struct
+{
+    bool pending;
+    bl_response_err_t err;
+    bl_opcode_t opcode;
+    uint32_t detail;
+} frame_nak BL_RAMDATA;
+
 static uint8_t response_buf[4104];
-static device_flash_info_t device_flash_info;
-static bl_ctrl_t packet;
+static K_MUTEX_DEFINE(response_lock);    // request responses and job pushes share the frame
+static uint8_t ctrl_frame[BL_CTRL_FRAME_SIZE] BL_RAMDATA;
+static bl_ctrl_t packet BL_RAMDATA;
 static bl_ctrl_t *pkt = &packet;
 
 void goto_app_main(void)
 {
-    volatile uint32_t *app_vt = (uint32_t*)device_flash_info.app_base_addr;
+    volatile uint32_t *app_vt = (uint32_t*)APP_BASE_ADDR;
     uint32_t app_msp = app_vt[0];
     void (*app_main)(void) = (void (*)(void))app_vt[1];
 
+    uint32_t start = boot_timeline_start();
+
     LOG_WRN("goto app main: PC: 0x%08x, SP: 0x%08x", app_vt[1], app_msp);
 
-    k_sleep(K_MSEC(20));
+    bl_upgrade_tx_drain();  // last response byte leaves the uart shift register
+    boot_timeline_stop(BOOT_STAGE_JUMP, start);
+    boot_timeline_commit(jump_path);
     irq_lock();
 
     __ISB();
@@ -126,8 +204,22 @@ void goto_app_main(void)
     while (1);
 }
 
-static void bl_response(bl_response_err_t err, bl_opcode_t opcode, uint8_t *data, uint16_t length)
+static bl_stat_id_t bl_opcode_stat(bl_opcode_t opcode)
 {
+    switch (opcode)
+    {
+        case OPCODE_INQUIRY: return BL_STAT_OP_INQUIRY;
+        case OPCODE_QUERY:   return BL_STAT_OP_QUERY;
+        case OPCODE_PROGRAM: return BL_STAT_OP_PROGRAM;
+        case OPCODE_ERASE:   return BL_STAT_OP_ERASE;
+        case OPCODE_VERIFY:  return BL_STAT_OP_VERIFY;
+        default:             return BL_STAT_OP_OTHER;
+    }
+}
+
+static void bl_frame_send(bl_response_err_t err, bl_opcode_t opcode, uint8_t *data, uint16_t length)
+{
+    k_mutex_lock(&response_lock, K_FOREVER);
     uint8_t *packet = response_buf;
     uint8_t *ptr = packet;
     const uint8_t header = 0xAA;
@@ -140,6 +232,18 @@ static void bl_response(bl_response_err_t err, bl_opcode_t opcode, uint8_t *data
     put_u16_inc(&ptr, crc);
     
     bl_upgrade_packet_send(response_buf, ptr - packet);
+    k_mutex_unlock(&response_lock);
+}
+
+static void bl_response(bl_response_err_t err, bl_opcode_t opcode, uint8_t *data, uint16_t length)
+{
+    bl_frame_send(err, opcode, data, length);
+    bl_trace(BL_TRACE_PKT_RESPONSE, opcode, err, length);
+
+    if (op_pending) {
+        op_pending = false;
+        bl_stats_stop(bl_opcode_stat(opcode), length, op_start);
+    }
 }
 
 static void bl_response_ack(bl_opcode_t opcode)
@@ -147,6 +251,30 @@ static void bl_response_ack(bl_opcode_t opcode)
     bl_response(BL_ERR_OK, opcode, NULL, 0);
 }
 
+static void bl_response_nak(bl_opcode_t opcode, bl_response_err_t err, uint32_t detail)
+{
+    bl_response(err, opcode, (uint8_t *)&detail, sizeof(detail));
+}
+
+static void bl_job_push(const bl_job_status_t *status)
+{
+    bl_frame_send(BL_ERR_OK, OPCODE_JOB_NOTIFY, (uint8_t *)status, sizeof(*status));
+}
+
+/* a long operation answers at once with its job id, the outcome is polled or pushed */
+static void bl_job_start(bl_opcode_t opcode, bl_job_fn_t fn, const void *arg, size_t size)
+{
+    uint8_t id;
+
+    if (bl_job_submit(opcode, fn, arg, size, &id) != 0)
+    {
+        LOG_ERR("job submit faild, opcode 0x%02x", opcode);
+        bl_response_nak(opcode, BL_ERR_BUSY, 0);
+        return;
+    }
+    bl_response(BL_ERR_OK, opcode, &id, sizeof(id));
+}
+
 static void bl_query_handler(void)
 {
     LOG_DBG("query state");
@@ -156,23 +284,23 @@ static void bl_query_handler(void)
     {
         LOG_ERR("query param length mismatch, expected: %u, got: %u", 
             sizeof(bl_query_info_t), pkt->length);
-        bl_response(BL_ERR_UNKNOWN, OPCODE_QUERY, NULL, 0);
+        bl_response_nak(OPCODE_QUERY, BL_ERR_BAD_PARAM, sizeof(bl_query_info_t));
         return;
     }
 
-    if (query->expect_arg_address != device_flash_info.arg_base_addr)
+    if (query->expect_arg_address != ARG_BASE_ADDR)
     {
         LOG_ERR("query expect arg address faild, expected: 0x%08x, got: 0x%08x",
-               device_flash_info.arg_base_addr, query->expect_arg_address);
-        bl_response(BL_ERR_UNKNOWN, OPCODE_QUERY, NULL, 0);
+               ARG_BASE_ADDR, query->expect_arg_address);
+        bl_response_nak(OPCODE_QUERY, BL_ERR_OUT_OF_RANGE, ARG_BASE_ADDR);
         return;
     }
 
-    if (query->expect_app_address != device_flash_info.app_base_addr)
+    if (query->expect_app_address != APP_BASE_ADDR)
     {
         LOG_ERR("query expect app address faild, expected: 0x%08x, got: 0x%08x",
-               device_flash_info.app_base_addr, query->expect_app_address);
-        bl_response(BL_ERR_UNKNOWN, OPCODE_QUERY, NULL, 0);
+               APP_BASE_ADDR, query->expect_app_address);
+        bl_response_nak(OPCODE_QUERY, BL_ERR_OUT_OF_RANGE, APP_BASE_ADDR);
         return;
     }
 
@@ -187,6 +315,13 @@ static void bl_inquiry_handler(void)
     LOG_DBG("inquiry state");
 
     bl_inquiry_info_t* inquiry = (bl_inquiry_info_t*)&pkt->data[4];
+    if (pkt->length != sizeof(bl_inquiry_info_t))
+    {
+        LOG_ERR("inquiry param faild");
+        bl_response_nak(OPCODE_INQUIRY, BL_ERR_BAD_PARAM, sizeof(bl_inquiry_info_t));
+        return;
+    }
+
     LOG_DBG("inquiry subcode: 0x%02x", inquiry->subcode);
     switch (inquiry->subcode)
     {
@@ -201,6 +336,48 @@ static void bl_inquiry_handler(void)
             bl_response(BL_ERR_OK, OPCODE_INQUIRY, (uint8_t*)&boot_size, sizeof(boot_size));
             break;
         }
+        case BL_INQUIRY_DIRECT_INSTALL:
+        {
+            if (!bl_active_backup_is_valid())
+            {
+                LOG_ERR("direct install refused, active backup not valid");
+                bl_response_nak(OPCODE_INQUIRY, BL_ERR_REFUSED, 0);
+                break;
+            }
+            direct_install = true;
+            direct_app_erased = false;
+            LOG_INF("direct install enabled");
+            bl_response_ack(OPCODE_INQUIRY);
+            break;
+        }
+#ifdef CONFIG_BL_STATS
+        case BL_INQUIRY_STATS:
+        {
+            static bl_stats_t stats;
+            bl_stats_snapshot(&stats);
+            bl_response(BL_ERR_OK, OPCODE_INQUIRY, (uint8_t*)&stats, sizeof(stats));
+            break;
+        }
+        case BL_INQUIRY_STATS_RESET:
+        {
+            bl_stats_reset();
+            bl_response_ack(OPCODE_INQUIRY);
+            break;
+        }
+#endif
+#ifdef CONFIG_BL_BOOT_TIMELINE
+        case BL_INQUIRY_BOOT_TIMELINE:
+        {
+            bl_response(BL_ERR_OK, OPCODE_INQUIRY, (uint8_t*)boot_timeline_get(), sizeof(boot_timeline_t));
+            break;
+        }
+#endif
+        default:
+        {
+            LOG_ERR("inquiry subcode 0x%02x not supported", inquiry->subcode);
+            bl_response_nak(OPCODE_INQUIRY, BL_ERR_UNSUPPORTED, 0);
+            break;
+        }
     }
 }
 
@@ -211,33 +388,115 @@ static void bl_reset_handler(void)
     NVIC_SystemReset();
 }
 
-static void bl_boot_handler(void)
+static void bl_log_upgrade_stats(void)
 {
-    LOG_DBG("boot state");
+    nor_erase_stats_t nor;
+    int_erase_stats_t intf;
+
+    nor_erase_stats_get(&nor);
+    bl_flash_erase_stats_get(&intf);
+
+    LOG_INF("upgrade stats: nor erase %u sector, %u block, %u chip, %u skipped blank, %u bytes, %u ms (est. saved ~%u ms)",
+            nor.sector_ops, nor.block_ops, nor.chip_ops, nor.blank_skips, nor.erased_bytes, nor.elapsed_ms,
+            nor.saved_est_ms);
+    LOG_INF("upgrade stats: internal erase %u sector, %u skipped blank",
+            intf.erase_ops, intf.blank_skips);
+    if (upgrade_start_ms != 0)
+        LOG_INF("upgrade stats: %s install, %u ms from erase to boot",
+                direct_install ? "direct" : "staged", k_uptime_get_32() - upgrade_start_ms);
+}
+
+/* the image an upgrade just promoted joins the archive */
+static void bl_archive_running_image(void)
+{
+#ifdef CONFIG_BL_ARCHIVE_STORE
+    uint32_t fwaddr, fwsize, fwcrc;
+
+    if (!bl_flash_get_arginfo(&fwaddr, &fwsize, &fwcrc))
+        return;
+    if (archive_store_image(fwsize, fwcrc) != 0)
+        LOG_ERR("archive store faild");
+#endif
+}
 
-    bl_response_ack(OPCODE_BOOT);
+/*
+ * A PROMOTE record goes in before the slot roles swap, so a resume never
+ * copies from the diff slot once it may already hold the old backup. When
+ * the active backup matches the installed image the swap is already done.
+ */
+static int bl_promote_diff_image(void)
+{
+    uint32_t fwaddr, fwsize, fwcrc, bsize, bcrc;
 
-    int check = ota_update_task();
+    if (!bl_flash_get_arginfo(&fwaddr, &fwsize, &fwcrc))
+        return -EIO;
+    if (nor_active_backup_info(&bsize, &bcrc) && bsize == fwsize && bcrc == fwcrc) {
+        LOG_INF("slot roles already promoted, crc 0x%08x", fwcrc);
+        return 0;
+    }
+
+    int ret = nor_journal_append(JOURNAL_PROMOTE, fwsize, fwcrc, 0);
+    if (ret != 0)
+        return ret;
+    return select_slot_to_active_backup_partition(DIFF_PACKAGE_FLAG);
+}
+
+/* patch or copy, promote and archive, then jump: the whole update is one job */
+static int bl_boot_job(void *arg)
+{
+    int check = 0;
     int ret = 0;
-    if (check != 0 && check == FULL_PACKAGE_FLAG)
+    if (direct_install)
+    {
+        // image is already in internal flash and verified, only the backup is left
+        LOG_INF("direct install, promote download slot to active backup");
+        bl_job_progress(BL_JOB_PHASE_BACKUP, 0, 1);
+        ret = select_slot_to_active_backup_partition(FULL_PACKAGE_FLAG);
+    }
+    else if ((check = ota_update_task(meta->package_len)) != 0 && check == FULL_PACKAGE_FLAG)
     {
         ret = download_slot_to_intflash();
         if (ret != 0) {
             LOG_ERR("download slot to int flash error: %d", ret);
-            return;
+            return ret;
         }
         LOG_INF("full package update success!"); // 全量更新时从download分区备份
+        bl_job_progress(BL_JOB_PHASE_BACKUP, 0, 1);
         ret = select_slot_to_active_backup_partition(FULL_PACKAGE_FLAG);
 
     } else if (check == DIFF_PACKAGE_FLAG) {
-        ret = select_slot_to_active_backup_partition(DIFF_PACKAGE_FLAG);
+        bl_job_progress(BL_JOB_PHASE_BACKUP, 0, 1);
+        ret = bl_promote_diff_image();
+        nor_journal_append(JOURNAL_IDLE, 0, 0, 0);
+    } else {
+        ret = check;    // patch refused, the application is left as it was
     }
 
     if (ret != 0) {
         LOG_ERR("active back error");
     }
+    else if (direct_install || check == FULL_PACKAGE_FLAG || check == DIFF_PACKAGE_FLAG) {
+        bl_archive_running_image();
+    }
 
+    bl_log_upgrade_stats();
+    bl_job_complete(ret);
     goto_app_main();
+    return ret;
+}
+
+static void bl_boot_handler(void)
+{
+    LOG_DBG("boot state");
+
+    bl_job_start(OPCODE_BOOT, bl_boot_job, NULL, 0);
+}
+
+static int bl_erase_job(void *arg)
+{
+    int ret = nor_flash_erase_download_slot();
+
+    return ret > 0 ? -EIO : ret;
 }
 
 static void bl_erase_handler(void)
@@ -247,46 +506,97 @@ static void bl_erase_handler(void)
     if (pkt->length != sizeof(bl_erase_info_t))
     {
         LOG_ERR("erase it param faild");
-        bl_response(BL_ERR_UNKNOWN, OPCODE_ERASE, NULL, 0);
+        bl_response_nak(OPCODE_ERASE, BL_ERR_BAD_PARAM, sizeof(bl_erase_info_t));
         return;
     }
 
-    if (erase->address >= device_flash_info.boot_base_addr && 
-        erase->address < (device_flash_info.boot_base_addr + device_flash_info.boot_flash_size))
+    const partition_desc_t *part = partition_lookup(erase->address, erase->size);
+    if (part == NULL)
     {
         LOG_ERR("it addr not erase");
-        bl_response(BL_ERR_UNKNOWN, OPCODE_ERASE, NULL, 0);
+        bl_response_nak(OPCODE_ERASE, BL_ERR_OUT_OF_RANGE, APP_BASE_ADDR);
         return;
     }
 
-    if (erase->address >= device_flash_info.app_base_addr &&
-        erase->address + erase->size <= device_flash_info.app_base_addr + device_flash_info.app_flash_size)
+    if (part->id == PART_APPLICATION)
     {
+        upgrade_start_ms = k_uptime_get_32();
+        direct_app_erased = false;
         meta->firmware_addr = erase->address;
         meta->firmware_size = erase->size;
+        meta->download_len = 0;
+        meta->package_len = 0;
         strcpy(meta->firmware_version, BL_BOOT_VERSION);
+        // a new download replaces whatever update the journal still holds
+        nor_journal_append(JOURNAL_IDLE, 0, 0, 0);
 
-        int ret;
-        ret = nor_flash_erase_download_slot();
+        bl_job_start(OPCODE_ERASE, bl_erase_job, NULL, 0);
+    }
+
+    else if (part->id == PART_ARG_INFO)
+    {
+        // arg info is a record log, the sector is only erased once it is full
+        int ret = bl_arginfo_prepare();
         if (ret != 0) {
-            bl_response(BL_ERR_UNKNOWN, OPCODE_ERASE, NULL, 0);
+            LOG_ERR("arg info prepare faild, ret %d", ret);
+            bl_response_nak(OPCODE_ERASE, BL_ERR_FLASH, ret);
             return;
         }
 
-        bl_response_ack(OPCODE_ERASE);    // erase successful
+        bl_response_ack(OPCODE_ERASE);
+    }
+}
+
+#ifdef CONFIG_BL_ARCHIVE_STORE
+/*
+ * Restores an archived version into the application partition, the host
+ * follows with RESET: BOOT would apply the download slot again.
+ */
+static int bl_rollback_job(void *arg)
+{
+    bl_rollback_info_t *rollback = arg;
+
+    return archive_rollback(rollback->size, rollback->crc);
+}
+
+static void bl_rollback_handler(void)
+{
+    LOG_DBG("rollback state");
+    bl_rollback_info_t *rollback = (bl_rollback_info_t *)&pkt->data[4];
+    if (pkt->length != sizeof(bl_rollback_info_t))
+    {
+        LOG_ERR("rollback param faild");
+        bl_response_nak(OPCODE_ROLLBACK, BL_ERR_BAD_PARAM, sizeof(bl_rollback_info_t));
+        return;
     }
 
-    else if (erase->address >= device_flash_info.arg_base_addr &&
-             erase->address + erase->size <= device_flash_info.arg_base_addr + device_flash_info.arg_flash_size)
+    bl_job_start(OPCODE_ROLLBACK, bl_rollback_job, rollback, sizeof(*rollback));
+}
+#endif
+
+/*
+ * The application is only erased once the first frame shows a full package,
+ * a diff package falls back to the staged flow and leaves the app untouched.
+ */
+static int bl_direct_program(bl_program_info_t *program)
+{
+    if (!direct_app_erased)
     {
-        int ret = bl_flash_erase(erase->address, erase->size);
-        if (ret != 0) {
-            bl_response(BL_ERR_UNKNOWN, OPCODE_ERASE, NULL, 0);
-            return;
+        if (program->address == APP_BASE_ADDR && program->size >= strlen(DIFF_PACKAGE_MAGIC) &&
+            memcmp(program->data, DIFF_PACKAGE_MAGIC, strlen(DIFF_PACKAGE_MAGIC)) == 0)
+        {
+            LOG_WRN("diff package, direct install disabled");
+            direct_install = false;
+            return 0;
         }
 
-        bl_response_ack(OPCODE_ERASE);
+        int ret = bl_flash_erase(APP_BASE_ADDR, meta->firmware_size);
+        if (ret != 0)
+            return ret;
+        direct_app_erased = true;
     }
+
+    return bl_flash_program(program->address, program->size, program->data);
 }
 
 static void bl_program_handler(void)
@@ -297,50 +607,83 @@ static void bl_program_handler(void)
     if (pkt->length != sizeof(bl_program_info_t) + program->size)
     {
         LOG_ERR("program it param faild");
-        bl_response(BL_ERR_UNKNOWN, OPCODE_PROGRAM, NULL, 0);
+        bl_response_nak(OPCODE_PROGRAM, BL_ERR_BAD_PARAM, sizeof(bl_program_info_t) + program->size);
         return;
     }
 
-    if (program->address >= device_flash_info.boot_base_addr && 
-        program->address < (device_flash_info.boot_base_addr + device_flash_info.boot_flash_size))
+    const partition_desc_t *part = partition_lookup(program->address, program->size);
+    if (part == NULL)
     {
         LOG_ERR("it addr not write");
-        bl_response(BL_ERR_UNKNOWN, OPCODE_PROGRAM, NULL, 0);
+        bl_response_nak(OPCODE_PROGRAM, BL_ERR_OUT_OF_RANGE, APP_BASE_ADDR);
         return;
     }
 
-    if (program->address >= device_flash_info.app_base_addr &&
-        program->address + program->size <= device_flash_info.app_base_addr + device_flash_info.app_flash_size)
+    if (part->id == PART_APPLICATION)
     {
-        meta->download_len += program->size;
-        meta->firmware_state = NEW;
-        meta->is_program = 1;
+        // the download is written in order, a lost frame shows as a gap at the next one
+        uint32_t expected = meta->firmware_addr + meta->download_len;
+        if (program->address + program->size == expected && program->size > 0)
+        {
+            LOG_WRN("program 0x%08x repeated, already written", program->address);
+            bl_response_ack(OPCODE_PROGRAM);
+            return;
+        }
+        if (program->address != expected)
+        {
+            LOG_ERR("program sequence gap, expected 0x%08x, got 0x%08x", expected, program->address);
+            bl_response_nak(OPCODE_PROGRAM, BL_ERR_SEQ_GAP, expected);
+            return;
+        }
 
         int ret;
+        if (direct_install)
+        {
+            ret = bl_direct_program(program);
+            if (ret != 0)
+            {
+                LOG_ERR("direct program faild, ret %d", ret);
+                bl_response_nak(OPCODE_PROGRAM, BL_ERR_FLASH, ret);
+                return;
+            }
+        }
+
         ret = nor_flash_program_download_slot(program->address, program->size, program->data);
         if (ret != 0)
         {
-            bl_response(BL_ERR_UNKNOWN, OPCODE_PROGRAM, NULL, 0);
+            LOG_ERR("download slot program faild, ret %d", ret);
+            bl_response_nak(OPCODE_PROGRAM, BL_ERR_FLASH, ret);
             return;
         }
 
+        meta->download_len += program->size;
+        meta->firmware_state = NEW;
+        meta->is_program = 1;
+
+        // the data is in, a retry of this frame is acked as a repeat and the next frame writes the meta again
         ret = nor_flash_program_meta_slot(meta);
         if (ret != 0)
         {
             LOG_ERR("backup meta is faild");
+            bl_response_nak(OPCODE_PROGRAM, BL_ERR_FLASH, ret);
             return;
         }
 
         bl_response_ack(OPCODE_PROGRAM);
     }
 
-    else if(program->address >= device_flash_info.arg_base_addr &&
-            program->address + program->size <= device_flash_info.arg_base_addr + device_flash_info.arg_flash_size)
+    else if (part->id == PART_ARG_INFO)
     {
-        int ret = bl_flash_program(program->address, program->size, program->data);
+        int ret;
+        // a whole record at the partition base is appended to the next free slot
+        if (program->address == ARG_BASE_ADDR && program->size == ARG_INFO_BYTE_NUMBER)
+            ret = bl_arginfo_append(program->data) ? 0 : -EIO;
+        else
+            ret = bl_flash_program(program->address, program->size, program->data);
         if (ret != 0)
         {
-            bl_response(BL_ERR_UNKNOWN, OPCODE_PROGRAM, NULL, 0);
+            LOG_ERR("arg info program faild, ret %d", ret);
+            bl_response_nak(OPCODE_PROGRAM, BL_ERR_FLASH, ret);
             return;
         }
 
@@ -354,40 +697,70 @@ static void bl_verify_handler(void)
     if (pkt->length != sizeof(bl_verify_info_t))
     {
         LOG_ERR("verify it param faild, expected: %u, got: %u", sizeof(bl_verify_info_t), pkt->length);
+        bl_response_nak(OPCODE_VERIFY, BL_ERR_BAD_PARAM, sizeof(bl_verify_info_t));
         return;
     }
 
     uint32_t crc = 0;
-    if (verify->address >= device_flash_info.app_base_addr &&
-        verify->address + verify->size <=
-        device_flash_info.app_base_addr + device_flash_info.app_flash_size)
+    const partition_desc_t *part = partition_lookup(verify->address, verify->size);
+    if (part == NULL)
+    {
+        LOG_ERR("verify range out of partition");
+        bl_response_nak(OPCODE_VERIFY, BL_ERR_OUT_OF_RANGE, APP_BASE_ADDR);
+        return;
+    }
+
+    if (part->id == PART_APPLICATION)
     {
         crc = (uint32_t)download_slot_verify(verify->address, verify->size);
         if (crc != verify->crc)
         {
             LOG_ERR("verify faild: expected 0x%08x, got 0x%08x", crc, verify->crc);
+            bl_response_nak(OPCODE_VERIFY, BL_ERR_VERIFY, crc);
             return;
         }
 
+        if (direct_install)
+        {
+            crc = (uint32_t)crc32_ieee((const uint8_t *)verify->address, (size_t)verify->size);
+            if (crc != verify->crc)
+            {
+                LOG_ERR("direct verify faild: expected 0x%08x, got 0x%08x", crc, verify->crc);
+                bl_response_nak(OPCODE_VERIFY, BL_ERR_VERIFY, crc);
+                return;
+            }
+        }
+
         LOG_INF("verify success, crc 0x%08x", crc);
 
         int ret;
         // 此时download分区已经完成应有工作，将meta_a分区中的download_len刷写成0, 由于上位机尚未实现, 逻辑功能不完整
         // 应在握手前检查download分区已有数据的CRC，校验通过执行断点续传, 校验失败重传所有数据
+        // BOOT patches or copies package_len bytes, a repeated VERIFY keeps the first length
+        if (meta_desc.download_len != 0)
+            meta_desc.package_len = meta_desc.download_len;
         meta_desc.download_len = 0;
         ret = nor_flash_program_meta_slot(meta);
         if (ret != 0)
+        {
+            LOG_ERR("verify meta write faild, ret %d", ret);
+            bl_response_nak(OPCODE_VERIFY, BL_ERR_FLASH, ret);
             return;
+        }
 
         bl_response_ack(OPCODE_VERIFY); // verify successful
     }
-    else if(verify->address >= device_flash_info.arg_base_addr &&
-            device_flash_info.arg_base_addr + device_flash_info.arg_flash_size)
+    else if (part->id == PART_ARG_INFO)
     {
-        crc = (uint32_t)crc32_ieee((const uint8_t *)verify->address, (size_t)verify->size);
+        uint8_t info[ARG_INFO_BYTE_NUMBER];
+        if (verify->address == ARG_BASE_ADDR && verify->size == ARG_INFO_BYTE_NUMBER && bl_arginfo_read(info))
+            crc = (uint32_t)crc32_ieee(info, sizeof(info));
+        else
+            crc = (uint32_t)crc32_ieee((const uint8_t *)verify->address, (size_t)verify->size);
         if (crc != verify->crc)
         {
             LOG_ERR("verify faild: expected 0x%08x, got 0x%08x", crc, verify->crc);
+            bl_response_nak(OPCODE_VERIFY, BL_ERR_VERIFY, crc);
             return;
         }
 
@@ -396,8 +769,71 @@ static void bl_verify_handler(void)
     }
 }
 
+#ifdef CONFIG_BL_TRACE
+typedef struct
+{
+    uint32_t seq;
+} bl_trace_read_info_t;
+
+/* records from seq on, as many as fit one response */
+static void bl_trace_read_handler(void)
+{
+    LOG_DBG("trace read state");
+    bl_trace_read_info_t *read = (bl_trace_read_info_t *)&pkt->data[4];
+    if (pkt->length != sizeof(bl_trace_read_info_t))
+    {
+        LOG_ERR("trace read param faild");
+        bl_response_nak(OPCODE_TRACE_READ, BL_ERR_BAD_PARAM, sizeof(bl_trace_read_info_t));
+        return;
+    }
+
+    uint8_t *dump = mem_arena_page();
+    uint32_t len = bl_trace_read(read->seq, dump, MIN(BL_BOOT_MTU_SIZE, MEM_PAGE_SIZE));
+    bl_response(BL_ERR_OK, OPCODE_TRACE_READ, dump, len);
+}
+#endif
+
+static void bl_job_status_handler(void)
+{
+    LOG_DBG("job status state");
+    bl_job_status_t status;
+
+    bl_job_status(&status);
+    bl_response(BL_ERR_OK, OPCODE_JOB_STATUS, (uint8_t *)&status, sizeof(status));
+}
+
+/* requests that touch flash or the arena page wait for the running job */
+static bool bl_opcode_exclusive(bl_opcode_t opcode)
+{
+    switch (opcode)
+    {
+        case OPCODE_ERASE:
+        case OPCODE_PROGRAM:
+        case OPCODE_VERIFY:
+        case OPCODE_BOOT:
+        case OPCODE_ROLLBACK:
+        case OPCODE_TRACE_READ:
+            return true;
+        case OPCODE_INQUIRY:
+            return pkt->data[4] == BL_INQUIRY_DIRECT_INSTALL;
+        default:
+            return false;
+    }
+}
+
 bool bl_pkt_handler(void)
 {
+    op_start = bl_stats_start();
+    op_pending = true;
+    bl_trace(BL_TRACE_PKT_DISPATCH, pkt->opcode, pkt->length, 0);
+
+    if ((!session_open || bl_job_busy()) && bl_opcode_exclusive(pkt->opcode))
+    {
+        LOG_WRN("opcode 0x%02x refused, flash busy", pkt->opcode);
+        bl_response_nak(pkt->opcode, BL_ERR_BUSY, 0);
+        return true;
+    }
+
     switch (pkt->opcode)
     {
         case OPCODE_QUERY:
@@ -415,10 +851,13 @@ bool bl_pkt_handler(void)
             bl_erase_handler();
             return true;
         }
-        case OPCODE_READ:
+#ifdef CONFIG_BL_TRACE
+        case OPCODE_TRACE_READ:
         {
+            bl_trace_read_handler();
             return true;
         }
+#endif
         case OPCODE_PROGRAM:
         {
             bl_program_handler();
@@ -429,6 +868,11 @@ bool bl_pkt_handler(void)
             bl_reset_handler();
             return true;
         }
+        case OPCODE_JOB_STATUS:
+        {
+            bl_job_status_handler();
+            return true;
+        }
         case OPCODE_BOOT:
         {
             bl_boot_handler();
@@ -439,11 +883,20 @@ bool bl_pkt_handler(void)
             bl_verify_handler();
             return true;
         }
-        case OPCODE_UNKNOWN:
+#ifdef CONFIG_BL_ARCHIVE_STORE
+        case OPCODE_ROLLBACK:
+        {
+            bl_rollback_handler();
+            return true;
+        }
+#endif
+        default:
         {
+            // READ has no handler either, unknown opcodes are answered like it
+            LOG_ERR("opcode 0x%02x not supported", pkt->opcode);
+            bl_response_nak(pkt->opcode, BL_ERR_UNSUPPORTED, 0);
             return false;
         }
-        default: return false;
     }
 }
 
@@ -454,11 +907,54 @@ void bl_pkt_reset(void)
     pkt->length = 0;
     pkt->index = 0;
     pkt->crc = 0;
-    memset(pkt->data, 0, sizeof(pkt->data));
+    if (pkt->data)
+        memset(pkt->data, 0, pkt->size);
 }
 
+/*
+ * Called by the uart rx thread with the arena held. Frames go to the arena
+ * transfer region in the transfer phase and to ctrl_frame while a job owns
+ * the arena, a frame cut by the switch is dropped.
+ */
+void bl_pkt_bind(bool transfer)
+{
+    uint8_t *buf = transfer ? mem_arena_transfer()->request : ctrl_frame;
+
+    if (pkt->data == buf)
+        return;
+
+    if (pkt->state == DISCARD) {
+        // nothing of the frame is stored, the count goes on in the new buffer
+    } else if (pkt->index > 0 && transfer) {
+        memcpy(buf, pkt->data, pkt->index);
+    } else if (pkt->index > 0) {
+        LOG_WRN("frame dropped, arena handed to a job");
+        pkt->state = IDLE;
+        pkt->index = 0;
+    }
+    pkt->data = buf;
+    pkt->size = transfer ? MEM_REQUEST_SIZE : sizeof(ctrl_frame);
+}
+
+static void bl_frame_reject(bl_response_err_t err, uint32_t detail)
+{
+    frame_nak.err = err;
+    frame_nak.opcode = pkt->opcode;
+    frame_nak.detail = detail;
+    frame_nak.pending = true;
+}
+
+/* true once a frame is complete or rejected, bl_frame_nak_flush() tells which */
 bool bl_received_handler(uint8_t data)
 {
+    if (pkt->state == DISCARD)
+    {
+        // the payload of a rejected frame may hold start bytes, so it is skipped whole
+        if (++pkt->index == pkt->length + 6)
+            bl_pkt_reset();
+        return false;
+    }
+
     pkt->data[pkt->index++] = data;
     switch (pkt->state)
     {
@@ -485,10 +981,14 @@ bool bl_received_handler(uint8_t data)
             if (pkt->index == 4)
             {
                 pkt->length = *(uint16_t*)&pkt->data[2];
-                if (pkt->length > sizeof(pkt->data) - 4)
+                if (pkt->length > pkt->size - 6)
                 {
-                    LOG_ERR("pkt Length faild");
-                    bl_pkt_reset();
+                    // while a job owns the arena only control frames fit
+                    bool busy = pkt->size < MEM_REQUEST_SIZE && pkt->length <= MEM_REQUEST_SIZE - 6;
+                    LOG_ERR("pkt Length faild, %u", pkt->length);
+                    bl_frame_reject(busy ? BL_ERR_BUSY : BL_ERR_OVERFLOW, busy ? 0 : MEM_REQUEST_SIZE - 6);
+                    pkt->state = DISCARD;
+                    return true;
                 }
                 if (pkt->length == 0) pkt->state = VERIFY;
                 else                  pkt->state = DATA;
@@ -511,8 +1011,11 @@ bool bl_received_handler(uint8_t data)
                 if (pkt->crc != ccrc)
                 {
                     LOG_ERR("parse pkt crc faild, got 0x%08x, expected 0x%08x", pkt->crc, ccrc);
+                    bl_stats_frame_error();
+                    bl_trace(BL_TRACE_FRAME_CRC_ERR, pkt->opcode, pkt->crc, ccrc);
+                    bl_frame_reject(BL_ERR_BAD_CRC, ccrc);
                     bl_pkt_reset();
-                    return false;
+                    return true;
                 }
                 return true;
             }
@@ -527,37 +1030,145 @@ bool bl_received_handler(uint8_t data)
     return false;
 }
 
+/* sends the NAK of a rejected frame, false when the parser has a frame to dispatch */
+bool bl_frame_nak_flush(void)
+{
+    if (!frame_nak.pending)
+        return false;
+
+    bl_response_err_t err = frame_nak.err;
+    bl_opcode_t opcode = frame_nak.opcode;
+    uint32_t detail = frame_nak.detail;
+    frame_nak.pending = false;
+
+    bl_response_nak(opcode, err, detail);
+    return true;
+}
+
 void bl_print_log(void)
 {
     LOG_DBG("packet info: header: 0x%02x", pkt->data[0]);
     LOG_DBG("packet info: opcode: 0x%02x", pkt->opcode);
     LOG_DBG("info: length: %u", pkt->length);
-    LOG_DBG("info: data:");
-    if (pkt->length > 0) 
-    {
-         for (uint32_t i = 0; i < pkt->length; i++)
-        {
-            printk ("%02x ", pkt->data[i + 4]);
-        }
-    }
+    if (pkt->length > 0)
+        LOG_HEXDUMP_DBG(&pkt->data[4], pkt->length, "info: data:");
     LOG_DBG("crc: 0x%08x", pkt->crc);
 }
 
+#ifdef CONFIG_BL_VERIFY_ONCE
+#define BL_VERIFY_SAMPLE_SIZE   256
+#define BL_RAM_IN(label, addr)  ((addr) > DT_REG_ADDR(DT_NODELABEL(label)) && \
+                                 (addr) <= DT_REG_ADDR(DT_NODELABEL(label)) + DT_REG_SIZE(DT_NODELABEL(label)))
+#if DT_NODE_EXISTS(DT_NODELABEL(retained_ram))
+#define BL_APP_SP_VALID(addr)   (BL_RAM_IN(sram0, addr) || BL_RAM_IN(ccm0, addr) || BL_RAM_IN(retained_ram, addr))
+#else
+#define BL_APP_SP_VALID(addr)   (BL_RAM_IN(sram0, addr) || BL_RAM_IN(ccm0, addr))
+#endif
+
+/* initial SP inside SRAM or CCM, reset handler a thumb address inside the image */
+static bool bl_app_vector_valid(uint32_t fwaddr, uint32_t fwsize)
+{
+    const uint32_t *vt = (const uint32_t *)fwaddr;
+    uint32_t msp = vt[0], pc = vt[1];
+
+    if ((msp & 0x3) || !BL_APP_SP_VALID(msp))
+        return false;
+    return (pc & 0x1) && (pc & ~0x1) >= fwaddr && (pc & ~0x1) < fwaddr + fwsize;
+}
+
+/* crc over fixed samples spread evenly over the image, the tail always included */
+static uint32_t bl_app_sample_crc(uint32_t fwaddr, uint32_t fwsize)
+{
+    uint32_t count = CONFIG_BL_VERIFY_SAMPLE_COUNT;
+    uint32_t crc = 0;
+
+    if (fwsize <= count * BL_VERIFY_SAMPLE_SIZE)
+        return crc32_ieee((const uint8_t *)fwaddr, fwsize);
+
+    uint32_t stride = (fwsize - BL_VERIFY_SAMPLE_SIZE) / (count - 1);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t off = i == count - 1 ? fwsize - BL_VERIFY_SAMPLE_SIZE : i * stride;
+        crc = crc32_ieee_update(crc, (const uint8_t *)(fwaddr + off), BL_VERIFY_SAMPLE_SIZE);
+    }
+    return crc;
+}
+
+/*
+ * The RCC reset flags stick until cleared, so they are read once, handed to
+ * the application in the reset_cause retention area and cleared: the next
+ * soft reset then shows only its own cause.
+ */
+static uint32_t bl_reset_cause(void)
+{
+    static bool latched;
+    static uint32_t cause;
+
+    if (latched)
+        return cause;
+    latched = true;
+
+    if (hwinfo_get_reset_cause(&cause) != 0)
+        cause = 0;
+    hwinfo_clear_reset_cause();
+#if defined(CONFIG_RETENTION) && DT_NODE_EXISTS(DT_NODELABEL(reset_cause0))
+    const struct device *dev = DEVICE_DT_GET(DT_NODELABEL(reset_cause0));
+    if (device_is_ready(dev))
+        retention_write(dev, 0, (const uint8_t *)&cause, sizeof(cause));
+#endif
+    return cause;
+}
+
+/* a watchdog or brownout reset may come from a corrupt image, reads the latched cause */
+static bool bl_boot_after_fault(void)
+{
+    uint32_t cause = bl_reset_cause();
+
+    // BORRSTF is set on every power-on too, a brownout only counts without POR
+    if (cause & RESET_POR)
+        cause &= ~RESET_BROWNOUT;
+    return (cause & (RESET_WATCHDOG | RESET_BROWNOUT | RESET_CPU_LOCKUP)) != 0;
+}
+#endif
+
 static bool bl_verify_internal_flash_firmware(void)
 {
     uint32_t ccrc = 0, fwaddr = 0, fwsize = 0, fwcrc = 0; 
     bool check;
+    uint32_t start = boot_timeline_start();
     check = bl_flash_get_arginfo(&fwaddr, &fwsize, &fwcrc);
+    boot_timeline_stop(BOOT_STAGE_ARG_INFO, start);
     if (check)
     {
         LOG_DBG("Debug: arg info: address 0x%08x, size %u, crc 0x%08x", fwaddr, fwsize, fwcrc);
+        start = boot_timeline_start();
+#ifdef CONFIG_BL_VERIFY_ONCE
+        uint32_t sample_crc;
+        bool stamped = bl_verified_stamp_get(fwcrc, &sample_crc);
+        if (stamped && !bl_boot_after_fault())
+        {
+            if (bl_app_vector_valid(fwaddr, fwsize) && bl_app_sample_crc(fwaddr, fwsize) == sample_crc)
+            {
+                boot_timeline_stop(BOOT_STAGE_CRC_VERIFY, start);
+                LOG_INF("arg flash stamp valid: addr 0x%08x, size %u, crc 0x%08x", fwaddr, fwsize, fwcrc);
+                return true;
+            }
+            LOG_WRN("arg flash stamp check faild, full verify");
+        }
+#endif
         ccrc = crc32_ieee((const uint8_t *)fwaddr, (size_t)fwsize);
+        boot_timeline_stop(BOOT_STAGE_CRC_VERIFY, start);
+        bl_stats_stop(BL_STAT_CRC, fwsize, start);
         if (ccrc != fwcrc)
         {
             LOG_ERR("arg flash verify faild: expected 0x%08x, got 0x%08x", fwcrc, ccrc);
             return false; // Verify faild
         }
         LOG_INF("arg flash verify success: addr 0x%08x, size %u, crc 0x%08x", fwaddr, fwsize, ccrc);
+#ifdef CONFIG_BL_VERIFY_ONCE
+        // stamp once per install, a fault reset re-verifies without a new record
+        if (!stamped && bl_app_vector_valid(fwaddr, fwsize))
+            bl_verified_stamp_set(fwcrc, bl_app_sample_crc(fwaddr, fwsize));
+#endif
         return true;
     }
     else
@@ -567,38 +1178,134 @@ static bool bl_verify_internal_flash_firmware(void)
     }
 }
 
+/* a diff update cut by power loss is finished before the image is verified */
+static void bl_resume_upgrade(void)
+{
+    uint32_t start = boot_timeline_start();
+    int ret = ota_resume_task();
+
+    boot_timeline_stop(BOOT_STAGE_RESUME, start);
+    // pending without an active record: cut before the first record or in a journal bank erase
+    if (ret == -ENOENT && bl_upgrade_pending()) {
+        LOG_WRN("upgrade pending but journal idle, clear pending");
+        bl_upgrade_pending_set(false);
+    }
+    if (ret != 0)
+        return;
+
+    if (bl_promote_diff_image() != 0)
+        LOG_ERR("active back error");
+    else
+        bl_archive_running_image();
+    nor_journal_append(JOURNAL_IDLE, 0, 0, 0);
+}
+
 bool bl_verify_firmware(void)
 {
     if (bl_verify_internal_flash_firmware())
         return true;
 
-    if (bl_verify_external_norflash_firmware()) // check active backup partition crc correct, program int flash
-        return true;
+    uint32_t start = boot_timeline_start();
+    bool check = bl_verify_external_norflash_firmware(); // check active backup partition crc correct, program int flash
+    boot_timeline_stop(BOOT_STAGE_RECOVERY, start);
 
-    return false;
+    return check;
 }
   
-void boot_main(bool trap)
+/* sampled right after reset: key held down or upgrade requested by the app */
+static bool bl_boot_requested(void)
 {
-    get_device_flash_info(&device_flash_info);
+    bool request = false;
 
-    int ret = k_sem_take(&button_trap, K_SECONDS(3));
-    if (ret == 0)
-        trap = true;
-    
-    trap ? NULL : goto_app_main();
+#ifdef CONFIG_RETENTION_BOOT_MODE
+    if (bootmode_check(BOOT_MODE_TYPE_BOOTLOADER) > 0) {
+        LOG_INF("upgrade requested by application");
+        request = true;
+    }
+    bootmode_clear();
+#endif
 
+    if (bl_button_pressed()) {
+        LOG_INF("button held at reset");
+        request = true;
+    }
+    return request;
+}
+
+static bool bl_trap_window(void)
+{
+#if CONFIG_BL_BOOT_TRAP_WINDOW_MS > 0
+    uint32_t start = boot_timeline_start();
+    bool trap = k_sem_take(&button_trap, K_MSEC(CONFIG_BL_BOOT_TRAP_WINDOW_MS)) == 0;
+
+    boot_timeline_stop(BOOT_STAGE_TRAP_WINDOW, start);
+    return trap;
+#else
+    return false;
+#endif
+}
+
+void boot_main(bool trap)
+{
+    if (!trap && !bl_trap_window())
+        goto_app_main();
+
+    boot_timeline_commit(BOOT_PATH_TRAP);
+    bl_job_notify_register(bl_job_push);
+    mem_arena_enter(MEM_PHASE_TRANSFER);
+    session_open = true;
     LOG_WRN("trap boot wait upgrading");
 }
 
-void sys_init_thread(void *p1, void *p2, void *p3)
+/* uart, leds and norflash, only brought up when the bootloader stays or recovers */
+static void bl_subsys_init(void)
 {
-    LOG_INF("system init started...");
-    bl_button_init();
+    uint32_t start = boot_timeline_start();
     bl_led_init();
+    boot_timeline_stop(BOOT_STAGE_LED, start);
+
+    start = boot_timeline_start();
     bl_upgrade_uart_init();
+    boot_timeline_stop(BOOT_STAGE_UART, start);
+
+    start = boot_timeline_start();
     norflash_init();
-    bl_verify_firmware() ? boot_main(false) : boot_main(true);
+    partition_init_external();
+    nor_slot_roles_init();
+    boot_timeline_stop(BOOT_STAGE_NORFLASH, start);
+
+    jump_path = BOOT_PATH_FULL;
+}
+
+void sys_init_thread(void *p1, void *p2, void *p3)
+{
+    boot_timeline_stop(BOOT_STAGE_DEVICE_INIT, 0);
+#ifdef CONFIG_BL_VERIFY_ONCE
+    // latched on every boot, not only when a verify stamp asks for it
+    (void)bl_reset_cause();
+#endif
+
+    LOG_INF("system init started...");
+    uint32_t start = boot_timeline_start();
+    bl_button_init();
+    boot_timeline_stop(BOOT_STAGE_BUTTON, start);
+
+    start = boot_timeline_start();
+    partition_init_internal();
+    bool request = bl_boot_requested();
+    bool pending = bl_upgrade_pending();
+    boot_timeline_stop(BOOT_STAGE_INPUTS, start);
+
+    // happy path: internal flash only, the jump happens before any other peripheral is up
+    if (!request && !pending && bl_verify_internal_flash_firmware()) {
+        if (!bl_trap_window())
+            goto_app_main();
+        request = true;
+    }
+
+    bl_subsys_init();
+    bl_resume_upgrade();
+    bl_verify_firmware() ? boot_main(request) : boot_main(true);
 }
 
 K_THREAD_DEFINE(sys_init_id, 2048, sys_init_thread, NULL, NULL, NULL, 8, 0, 0);
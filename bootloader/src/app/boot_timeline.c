@@ -0,0 +1,49 @@
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/retention/retention.h>
+#include "boot_timeline.h"
+
+LOG_MODULE_REGISTER(boot_timeline, CONFIG_LOG_DEFAULT_LEVEL);
+
+static const struct device *const timeline_dev = DEVICE_DT_GET(DT_NODELABEL(boot_timeline0));
+
+static boot_timeline_t timeline = {
+    .version = BOOT_TIMELINE_VERSION,
+    .stage_count = BOOT_STAGE_COUNT,
+};
+
+uint32_t boot_timeline_start(void)
+{
+    return k_cycle_get_32();
+}
+
+/* a stage may run more than once (two verify attempts), the time adds up */
+void boot_timeline_stop(boot_stage_t stage, uint32_t start)
+{
+    timeline.stage_us[stage] += k_cyc_to_us_floor32(k_cycle_get_32() - start);
+}
+
+void boot_timeline_commit(boot_path_t path)
+{
+    timeline.path = path;
+    // the 32 bit cycle counter wraps after ~25 s at 168 MHz, a recovery boot can take longer
+    timeline.total_us = (uint32_t)k_ticks_to_us_floor64(k_uptime_ticks());
+
+    LOG_INF("boot timeline: path %u, total %u us, arg %u us, crc %u us, uart %u us, norflash %u us",
+            path, timeline.total_us, timeline.stage_us[BOOT_STAGE_ARG_INFO],
+            timeline.stage_us[BOOT_STAGE_CRC_VERIFY], timeline.stage_us[BOOT_STAGE_UART],
+            timeline.stage_us[BOOT_STAGE_NORFLASH]);
+
+    if (!device_is_ready(timeline_dev) || retention_size(timeline_dev) < sizeof(timeline)) {
+        LOG_ERR("boot timeline retention area faild");
+        return;
+    }
+    retention_write(timeline_dev, 0, (const uint8_t *)&timeline, sizeof(timeline));
+}
+
+const boot_timeline_t *boot_timeline_get(void)
+{
+    return &timeline;
+}
@@ -0,0 +1,57 @@
+#ifndef __BOOT_TIMELINE_H
+#define __BOOT_TIMELINE_H
+
+#include <stdint.h>
+
+#define BOOT_TIMELINE_VERSION   1
+
+typedef enum
+{
+    BOOT_STAGE_DEVICE_INIT,     // reset to sys_init_thread: kernel and driver init
+    BOOT_STAGE_BUTTON,
+    BOOT_STAGE_INPUTS,          // key level and retained boot mode
+    BOOT_STAGE_ARG_INFO,
+    BOOT_STAGE_CRC_VERIFY,
+    BOOT_STAGE_LED,
+    BOOT_STAGE_UART,
+    BOOT_STAGE_NORFLASH,
+    BOOT_STAGE_RESUME,
+    BOOT_STAGE_RECOVERY,        // active backup verify and copy to internal flash
+    BOOT_STAGE_TRAP_WINDOW,
+    BOOT_STAGE_JUMP,
+    BOOT_STAGE_COUNT
+} boot_stage_t;
+
+typedef enum
+{
+    BOOT_PATH_DIRECT,           // internal flash only
+    BOOT_PATH_FULL,             // norflash and uart brought up, then jumped
+    BOOT_PATH_TRAP,             // stayed in the bootloader
+} boot_path_t;
+
+/*
+ * Written to the boot_timeline retention area before the jump, the
+ * application reads it with retention_read() from the same devicetree
+ * node. Also returned by the boot timeline INQUIRY subcode.
+ */
+typedef struct
+{
+    uint16_t version;
+    uint8_t stage_count;
+    uint8_t path;
+    uint32_t total_us;          // reset to the record being written
+    uint32_t stage_us[BOOT_STAGE_COUNT];
+} boot_timeline_t;
+
+#ifdef CONFIG_BL_BOOT_TIMELINE
+uint32_t boot_timeline_start(void);
+void boot_timeline_stop(boot_stage_t stage, uint32_t start);
+void boot_timeline_commit(boot_path_t path);
+const boot_timeline_t *boot_timeline_get(void);
+#else
+static inline uint32_t boot_timeline_start(void) { return 0; }
+static inline void boot_timeline_stop(boot_stage_t stage, uint32_t start) { }
+static inline void boot_timeline_commit(boot_path_t path) { }
+#endif
+
+#endif
@@ -0,0 +1,125 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+#include "decomp.h"
+
+LOG_MODULE_REGISTER(decomp, CONFIG_LOG_DEFAULT_LEVEL);
+
+static tuz_BOOL tuz_read_raw(tuz_TInputStreamHandle handle, tuz_byte *buf, tuz_size_t *size)
+{
+    decomp_stream_t *s = (decomp_stream_t *)handle;
+    hpi_size_t len = *size;
+
+    if (!s->raw_read(s->raw_handle, buf, &len)) return tuz_FALSE;
+    *size = len;
+    return tuz_TRUE;
+}
+
+static int tuz_mem_required(decomp_stream_t *s, uint32_t *window_size)
+{
+    // the stream starts with the dictionary size it was compressed with
+    *window_size = tuz_TStream_read_dict_size(s, tuz_read_raw);
+    return *window_size ? 0 : -EIO;
+}
+
+static int tuz_open(decomp_stream_t *s, uint8_t *buf, uint32_t window_size, uint32_t cache_size)
+{
+    if (tuz_TStream_open(&s->state.tuz, s, tuz_read_raw, buf, window_size, cache_size) != tuz_OK)
+        return -EIO;
+    return 0;
+}
+
+static int tuz_partial(decomp_stream_t *s, uint8_t *out, uint32_t *size)
+{
+    tuz_size_t len = *size;
+    tuz_TResult ret = tuz_TStream_decompress_partial(&s->state.tuz, out, &len);
+
+    *size = len;
+    if (ret == tuz_OK) return 0;
+    if (ret == tuz_STREAM_END) return 1;
+    return -EIO;
+}
+
+#ifdef CONFIG_BL_DECOMP_LZ4
+static bool lz4_read_raw(void *handle, uint8_t *buf, uint32_t *size)
+{
+    decomp_stream_t *s = (decomp_stream_t *)handle;
+    hpi_size_t len = *size;
+
+    if (!s->raw_read(s->raw_handle, buf, &len)) return false;
+    *size = len;
+    return true;
+}
+
+static int lz4_mem_required(decomp_stream_t *s, uint32_t *window_size)
+{
+    *window_size = lz4_dec_read_block_size(s, lz4_read_raw);
+    return *window_size ? 0 : -EIO;
+}
+
+static int lz4_open(decomp_stream_t *s, uint8_t *buf, uint32_t window_size, uint32_t cache_size)
+{
+    return lz4_dec_open(&s->state.lz4, s, lz4_read_raw, buf, window_size, cache_size);
+}
+
+static int lz4_partial(decomp_stream_t *s, uint8_t *out, uint32_t *size)
+{
+    return lz4_dec_read(&s->state.lz4, out, size);
+}
+#endif
+
+static const decomp_codec_t codecs[] = {
+    { hpi_compressType_tuz, "tinyuz", tuz_mem_required, tuz_open, tuz_partial },
+#ifdef CONFIG_BL_DECOMP_LZ4
+    { hpi_compressType_lz4, "lz4", lz4_mem_required, lz4_open, lz4_partial },
+#endif
+};
+
+const decomp_codec_t *decomp_find(hpi_compressType type)
+{
+    for (int i = 0; i < ARRAY_SIZE(codecs); i++) {
+        if (codecs[i].type == type)
+            return &codecs[i];
+    }
+    return NULL;
+}
+
+int decomp_init(decomp_stream_t *s, hpi_compressType type,
+                hpi_TInputStreamHandle raw_handle, hpi_TInputStream_read raw_read)
+{
+    memset(s, 0, sizeof(*s));
+    s->codec = decomp_find(type);
+    if (!s->codec) {
+        LOG_ERR("unsupported compress type %d", type);
+        return -ENOTSUP;
+    }
+
+    s->raw_handle = raw_handle;
+    s->raw_read = raw_read;
+    return 0;
+}
+
+int decomp_window_size(decomp_stream_t *s, uint32_t *window_size)
+{
+    int ret = s->codec->mem_required(s, window_size);
+
+    if (ret != 0)
+        LOG_ERR("%s header read faild", s->codec->name);
+    return ret;
+}
+
+int decomp_open(decomp_stream_t *s, uint8_t *buf, uint32_t window_size, uint32_t cache_size)
+{
+    int ret = s->codec->open(s, buf, window_size, cache_size);
+
+    if (ret != 0)
+        LOG_ERR("%s open faild, ret %d", s->codec->name, ret);
+    return ret;
+}
+
+int decomp_read(void *s, uint8_t *out, uint32_t *size)
+{
+    decomp_stream_t *stream = (decomp_stream_t *)s;
+
+    return stream->codec->decompress_partial(stream, out, size);
+}
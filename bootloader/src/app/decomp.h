@@ -0,0 +1,51 @@
+#ifndef __DECOMP_H
+#define __DECOMP_H
+
+#include <stdint.h>
+#include "hpatch_lite_types.h"
+#include "tuz_dec.h"
+#ifdef CONFIG_BL_DECOMP_LZ4
+#include "lz4_dec.h"
+#endif
+
+typedef struct decomp_stream decomp_stream_t;
+
+/*
+ * One entry per hpi_compressType the bootloader can apply, the packer picks
+ * the codec per release: tinyuz for the smallest package, lz4 for the
+ * fastest patch.
+ */
+typedef struct
+{
+    hpi_compressType type;
+    const char *name;
+    /* reads the codec header, window is the buffer the codec decodes into */
+    int (*mem_required)(decomp_stream_t *s, uint32_t *window_size);
+    /* buf holds window_size + cache_size bytes */
+    int (*open)(decomp_stream_t *s, uint8_t *buf, uint32_t window_size, uint32_t cache_size);
+    /* return 0 while data follows, 1 at end of stream, negative on error */
+    int (*decompress_partial)(decomp_stream_t *s, uint8_t *out, uint32_t *size);
+} decomp_codec_t;
+
+struct decomp_stream
+{
+    const decomp_codec_t *codec;
+    hpi_TInputStreamHandle raw_handle;
+    hpi_TInputStream_read raw_read;     // compressed stream, may be swapped before open
+    union {
+        tuz_TStream tuz;
+#ifdef CONFIG_BL_DECOMP_LZ4
+        lz4_dec_t lz4;
+#endif
+    } state;
+};
+
+const decomp_codec_t *decomp_find(hpi_compressType type);
+int decomp_init(decomp_stream_t *s, hpi_compressType type,
+                hpi_TInputStreamHandle raw_handle, hpi_TInputStream_read raw_read);
+int decomp_window_size(decomp_stream_t *s, uint32_t *window_size);
+int decomp_open(decomp_stream_t *s, uint8_t *buf, uint32_t window_size, uint32_t cache_size);
+/* same contract as patch_pipe_decode_t */
+int decomp_read(void *s, uint8_t *out, uint32_t *size);
+
+#endif
@@ -4,9 +4,20 @@
 #include <zephyr/logging/log.h>
 #include <zephyr/sys/crc.h>
 #include "hpatch_lite.h"
-#include "tuz_dec.h"
 #include "flash_area.h"
 #include "hpatchlite.h"
+#include "nor_erase.h"
+#include "partition.h"
+#include "mem_plan.h"
+#include "mem_arena.h"
+#include "decomp.h"
+#include "norflash.h"
+#include "bl_stats.h"
+#include "bl_trace.h"
+#include "bl_job.h"
+#ifdef CONFIG_BL_PATCH_PIPELINE
+#include "patch_pipe.h"
+#endif
 
 LOG_MODULE_REGISTER(hpatchlite, CONFIG_LOG_DEFAULT_LEVEL);
 
@@ -15,58 +26,49 @@ LOG_MODULE_REGISTER(hpatchlite, CONFIG_LOG_DEFAULT_LEVEL);
     #define kCompressType_tuz 1
 #endif
 
+// base_size 0 marks a package built before base selection, patched against the application
 struct __packed ota_custom_header {
-    char magic[4]; uint32_t version; uint32_t new_size; uint32_t new_crc; uint8_t reserved[48];
+    char magic[4]; uint32_t version; uint32_t new_size; uint32_t new_crc;
+    uint32_t base_size; uint32_t base_crc; uint8_t reserved[40];
 };
 
-#define WRITE_BUF_SIZE 256
-
-struct patch_ctx {
-    const struct flash_area *fa_old;
-    const struct flash_area *fa_diff;
-    const struct flash_area *fa_new;
-    uint32_t write_addr_offset;
-    uint32_t read_diff_offset;
-    
-    uint8_t  write_buf[WRITE_BUF_SIZE];
-    uint16_t buf_fill;
+// searched in order, the first image whose crc32 matches the package base is patched against.
+// archived versions are deduplicated blocks, not a contiguous image, a ROLLBACK makes one the base
+static const partition_id_t patch_base_candidates[] = {
+    PART_APPLICATION, PART_ACTIVE_BACKUP, PART_FACTORY_FW,
 };
 
-typedef struct {
-    hpi_TInputStreamHandle  raw_stream_handle;
-    hpi_TInputStream_read   raw_read_cb;
-    tuz_TStream             tuz_stream;
-    uint8_t* dec_buffer; 
-} tuz_adapter_ctx_t;
+#define PATCH_CHECKPOINT_SIZE (16 * NOR_SECTOR_SIZE)
 
 static hpi_BOOL cb_read_diff(hpi_TInputStreamHandle diff_data, hpi_byte* out_data, hpi_size_t* data_size) {
     struct patch_ctx *ctx = (struct patch_ctx *)diff_data;
     hpi_size_t to_read = *data_size;
     if (to_read == 0) return hpi_TRUE;
+    uint32_t start = bl_stats_start();
     int ret = flash_area_read(ctx->fa_diff, ctx->read_diff_offset, out_data, to_read);
+    bl_stats_stop(BL_STAT_NOR_READ, to_read, start);
     if (ret != 0) { *data_size = 0; return hpi_FALSE; }
     *data_size = to_read;
     ctx->read_diff_offset += to_read;
     return hpi_TRUE;
 }
+static hpi_BOOL cb_read_diff_mem(hpi_TInputStreamHandle diff_data, hpi_byte* out_data, hpi_size_t* data_size) {
+    struct patch_ctx *ctx = (struct patch_ctx *)diff_data;
+    hpi_size_t to_read = MIN(*data_size, ctx->diff_mem_size - ctx->read_diff_offset);
+    memcpy(out_data, ctx->diff_mem + ctx->read_diff_offset, to_read);
+    *data_size = to_read;
+    ctx->read_diff_offset += to_read;
+    return hpi_TRUE;
+}
 static hpi_BOOL hpi_read_diff_adapter(hpi_TInputStreamHandle diff_data, hpi_byte* out_data, hpi_size_t* data_size) {
     return cb_read_diff(diff_data, out_data, data_size);
 }
 
-static tuz_BOOL _tuz_read_code_cb(tuz_TInputStreamHandle handle, tuz_byte* buf, tuz_size_t* data_size) {
-    tuz_adapter_ctx_t* ctx = (tuz_adapter_ctx_t*)handle;
-    hpi_size_t read_len = *data_size;
-    if (!ctx->raw_read_cb(ctx->raw_stream_handle, buf, &read_len)) return tuz_FALSE; 
-    *data_size = read_len;
-    return tuz_TRUE;
-}
-
-static hpi_BOOL _hpi_tuz_read_adapter(hpi_TInputStreamHandle handle, hpi_byte* out_data, hpi_size_t* data_size) {
-    tuz_adapter_ctx_t* ctx = (tuz_adapter_ctx_t*)handle;
-    tuz_size_t this_read_size = *data_size;
-    tuz_TResult ret = tuz_TStream_decompress_partial(&ctx->tuz_stream, out_data, &this_read_size);
+static hpi_BOOL _hpi_decomp_read_adapter(hpi_TInputStreamHandle handle, hpi_byte* out_data, hpi_size_t* data_size) {
+    uint32_t this_read_size = *data_size;
+    int ret = decomp_read(handle, out_data, &this_read_size);
     *data_size = this_read_size;
-    return (ret == tuz_OK || ret == tuz_STREAM_END) ? hpi_TRUE : hpi_FALSE;
+    return (ret >= 0) ? hpi_TRUE : hpi_FALSE;
 }
 
 static hpi_BOOL cb_read_old(hpatchi_listener_t* listener, hpi_pos_t read_from_pos, hpi_byte* out_data, hpi_size_t data_size) {
@@ -74,10 +76,14 @@ static hpi_BOOL cb_read_old(hpatchi_listener_t* listener, hpi_pos_t read_from_po
     return (flash_area_read(ctx->fa_old, (off_t)read_from_pos, out_data, data_size) == 0) ? hpi_TRUE : hpi_FALSE;
 }
 
-static hpi_BOOL cb_write_new(hpatchi_listener_t* listener, const hpi_byte* data, hpi_size_t data_size) {
-    struct patch_ctx *ctx = (struct patch_ctx *)listener->diff_data;
-    hpi_size_t len = data_size;
-    const uint8_t *p = data;
+static hpi_BOOL patch_write(struct patch_ctx *ctx, const uint8_t *p, hpi_size_t len) {
+    // a resumed patch replays the output that is already in flash
+    if (ctx->skip_len > 0) {
+        hpi_size_t skip = MIN(len, ctx->skip_len);
+        ctx->skip_len -= skip;
+        p += skip;
+        len -= skip;
+    }
 
     while (len > 0) {
         uint16_t space = WRITE_BUF_SIZE - ctx->buf_fill;
@@ -90,51 +96,118 @@ static hpi_BOOL cb_write_new(hpatchi_listener_t* listener, const hpi_byte* data,
 
         // if buffer is full, program in Flash
         if (ctx->buf_fill == WRITE_BUF_SIZE) {
+            uint32_t start = bl_stats_start();
             if (flash_area_write(ctx->fa_new, ctx->write_addr_offset, ctx->write_buf, WRITE_BUF_SIZE) != 0) {
                 LOG_ERR("flash write failed at %d", ctx->write_addr_offset);
                 return hpi_FALSE;
             }
+            bl_stats_stop(BL_STAT_NOR_PROGRAM, WRITE_BUF_SIZE, start);
             ctx->write_addr_offset += WRITE_BUF_SIZE;
             ctx->buf_fill = 0; // reset buffer
+
+            if (ctx->write_addr_offset % PATCH_CHECKPOINT_SIZE == 0) {
+                nor_journal_append(JOURNAL_PATCH, ctx->journal_size, ctx->journal_crc, ctx->write_addr_offset);
+                bl_job_progress(BL_JOB_PHASE_PATCH, ctx->write_addr_offset, ctx->journal_size);
+            }
         }
     }
     return hpi_TRUE;
 }
 
-static hpi_BOOL cb_read_old_tuz(hpatchi_listener_t* listener, hpi_pos_t read_from_pos, hpi_byte* out_data, hpi_size_t data_size) {
-    // get TinyUZ info
-    tuz_adapter_ctx_t* tuz_ctx = (tuz_adapter_ctx_t*)listener->diff_data;
-    struct patch_ctx *ctx = (struct patch_ctx *)tuz_ctx->raw_stream_handle;
+static hpi_BOOL cb_write_new(hpatchi_listener_t* listener, const hpi_byte* data, hpi_size_t data_size) {
+    return patch_write((struct patch_ctx *)listener->diff_data, data, data_size);
+}
+
+static hpi_BOOL cb_read_old_dec(hpatchi_listener_t* listener, hpi_pos_t read_from_pos, hpi_byte* out_data, hpi_size_t data_size) {
+    // get decompressor info
+    decomp_stream_t* dec = (decomp_stream_t*)listener->diff_data;
+    struct patch_ctx *ctx = (struct patch_ctx *)dec->raw_handle;
     
     return (flash_area_read(ctx->fa_old, (off_t)read_from_pos, out_data, data_size) == 0) ? hpi_TRUE : hpi_FALSE;
 }
 
-static hpi_BOOL cb_write_new_tuz(hpatchi_listener_t* listener, const hpi_byte* data, hpi_size_t data_size) {
-    tuz_adapter_ctx_t* tuz_ctx = (tuz_adapter_ctx_t*)listener->diff_data;
-    struct patch_ctx *ctx = (struct patch_ctx *)tuz_ctx->raw_stream_handle;
-    
-    hpi_size_t len = data_size;
-    const uint8_t *p = data;
+static hpi_BOOL cb_write_new_dec(hpatchi_listener_t* listener, const hpi_byte* data, hpi_size_t data_size) {
+    decomp_stream_t* dec = (decomp_stream_t*)listener->diff_data;
+    return patch_write((struct patch_ctx *)dec->raw_handle, data, data_size);
+}
 
-    while (len > 0) {
-        uint16_t space = WRITE_BUF_SIZE - ctx->buf_fill;
-        uint16_t to_copy = (len < space) ? len : space;
+#ifdef CONFIG_BL_PATCH_PIPELINE
+static hpi_BOOL pipe_read_diff_cb(hpi_TInputStreamHandle handle, hpi_byte* out_data, hpi_size_t* data_size) {
+    uint32_t size = *data_size;
+    bool ok = patch_pipe_read_diff(out_data, &size);
+    *data_size = size;
+    return ok ? hpi_TRUE : hpi_FALSE;
+}
 
-        memcpy(&ctx->write_buf[ctx->buf_fill], p, to_copy);
-        ctx->buf_fill += to_copy;
-        p += to_copy;
-        len -= to_copy;
+static hpi_BOOL pipe_read_code_cb(hpi_TInputStreamHandle handle, hpi_byte* out_data, hpi_size_t* data_size) {
+    uint32_t size = *data_size;
+    bool ok = patch_pipe_read_code(out_data, &size);
+    *data_size = size;
+    return ok ? hpi_TRUE : hpi_FALSE;
+}
 
-        if (ctx->buf_fill == WRITE_BUF_SIZE) {
-            if (flash_area_write(ctx->fa_new, ctx->write_addr_offset, ctx->write_buf, WRITE_BUF_SIZE) != 0) {
-                LOG_ERR("flash write faild at %d", ctx->write_addr_offset);
-                return hpi_FALSE;
-            }
-            ctx->write_addr_offset += WRITE_BUF_SIZE;
-            ctx->buf_fill = 0;
+static hpi_BOOL cb_write_new_pipe(hpatchi_listener_t* listener, const hpi_byte* data, hpi_size_t data_size) {
+    struct patch_ctx *ctx = (struct patch_ctx *)listener->diff_data;
+    if (ctx->skip_len > 0) {
+        hpi_size_t skip = MIN(data_size, ctx->skip_len);
+        ctx->skip_len -= skip;
+        data += skip;
+        data_size -= skip;
+        if (data_size == 0) return hpi_TRUE;
+    }
+    return patch_pipe_write(data, data_size) ? hpi_TRUE : hpi_FALSE;
+}
+
+// runs in the writer thread after every page
+static void pipe_progress_cb(void *handle, uint32_t written) {
+    struct patch_ctx *ctx = (struct patch_ctx *)handle;
+    if (written % PATCH_CHECKPOINT_SIZE == 0) {
+        nor_journal_append(JOURNAL_PATCH, ctx->journal_size, ctx->journal_crc, written);
+        bl_job_progress(BL_JOB_PHASE_PATCH, written, ctx->journal_size);
+    }
+}
+#endif
+
+static bool base_image_matches(partition_id_t id, const struct flash_area *fa, uint32_t size, uint32_t crc, uint8_t *buf) {
+    uint32_t known_size = 0, known_crc = 0, known_addr = 0;
+    uint32_t ccrc = 0;
+
+    if (size > fa->fa_size) return false;
+
+    // images with a recorded size and crc are compared without reading them
+    if (id == PART_APPLICATION && bl_flash_get_arginfo(&known_addr, &known_size, &known_crc) &&
+        known_size == size && known_crc == crc)
+        return true;
+    if (id == PART_ACTIVE_BACKUP && nor_active_backup_info(&known_size, &known_crc))
+        return known_size == size && known_crc == crc;
+
+    for (uint32_t offset = 0; offset < size; ) {
+        uint32_t len = MIN(size - offset, MEM_PAGE_SIZE);
+        if (flash_area_read(fa, offset, buf, len) != 0) return false;
+        // an erased first word is an empty slot, skip the rest
+        if (offset == 0 && *(uint32_t *)buf == 0xFFFFFFFF) return false;
+        ccrc = crc32_ieee_update(ccrc, buf, len);
+        offset += len;
+    }
+    return ccrc == crc;
+}
+
+static const struct flash_area *select_patch_base(uint32_t base_size, uint32_t base_crc) {
+    const struct flash_area *found = NULL;
+
+    if (base_size == 0) return partition_get(PART_APPLICATION);
+
+    uint8_t *buf = mem_arena_page();
+
+    for (int i = 0; i < ARRAY_SIZE(patch_base_candidates) && !found; i++) {
+        const struct flash_area *fa = partition_get(patch_base_candidates[i]);
+        if (fa && base_image_matches(patch_base_candidates[i], fa, base_size, base_crc, buf)) {
+            LOG_INF("patch base: partition %d, size %u, crc 0x%08x", patch_base_candidates[i], base_size, base_crc);
+            found = fa;
         }
     }
-    return hpi_TRUE;
+
+    return found;
 }
 
 // add refresh function api
@@ -153,15 +226,92 @@ static int flush_write_buffer(struct patch_ctx *ctx) {
     return 0;
 }
 
-int start_firmware_patch(uint32_t *out_new_size, uint32_t *out_new_crc) {
+/* resume_offset is a checkpoint, the output before it is replayed but not written */
+static void prepare_patch_output(struct patch_ctx *ctx, uint32_t resume_offset) {
+    if (resume_offset == 0) {
+        LOG_INF("eraseing backup partition...");
+        nor_flash_area_erase(ctx->fa_new, 0, ctx->fa_new->fa_size);
+        ctx->write_addr_offset = 0;
+        nor_journal_append(JOURNAL_PATCH, ctx->journal_size, ctx->journal_crc, 0);
+        return;
+    }
+
+    // pages past the checkpoint may be half programmed, blank sectors are skipped
+    LOG_WRN("resume patch at 0x%x", resume_offset);
+    nor_flash_area_erase(ctx->fa_new, resume_offset, ctx->fa_new->fa_size - resume_offset);
+    ctx->write_addr_offset = resume_offset;
+    ctx->skip_len = resume_offset;
+}
+
+#ifdef CONFIG_BL_PATCH_INRAM
+/*
+ * small packages: one bulk read of the diff, tinyuz decoded in memory, the
+ * patch then reads its diff with memcpy. -ENOMEM means nothing was touched
+ * and the caller falls back to streaming.
+ */
+static int patch_from_ram(struct patch_ctx *ctx, hpi_compressType compress_type, uint32_t code_size,
+                          hpi_pos_t uncompress_size, hpi_pos_t new_size) {
+    hpatchi_listener_t listener = {0};
+    patch_mem_plan_t mem_plan = {0};
+    uint32_t plain_size = (compress_type == kCompressType_tuz) ? uncompress_size : code_size;
+    uint32_t image_size = (compress_type == kCompressType_tuz) ? code_size + plain_size : code_size;
+    int ret;
+
+    if ((compress_type != kCompressType_no && compress_type != kCompressType_tuz) ||
+        image_size > CONFIG_BL_PATCH_INRAM_MAX)
+        return -ENOMEM;
+
+    ret = patch_mem_plan_inram(&mem_plan, image_size);
+    if (ret != 0) return ret;
+
+    uint8_t *code = mem_plan.dict_buf;
+    uint8_t *plain = code;
+    if (flash_area_read(ctx->fa_diff, ctx->read_diff_offset, code, code_size) != 0) {
+        LOG_ERR("diff bulk read faild"); ret = -EIO; goto cleanup;
+    }
+
+    if (compress_type == kCompressType_tuz) {
+        tuz_size_t len = plain_size;
+        plain = code + code_size;
+        if (tuz_decompress_mem(code, code_size, plain, &len) != tuz_STREAM_END || len != plain_size) {
+            LOG_ERR("tinyuz mem decompress faild"); ret = -EIO; goto cleanup;
+        }
+    }
+
+    ctx->diff_mem = plain;
+    ctx->diff_mem_size = plain_size;
+    ctx->read_diff_offset = 0;
+
+    prepare_patch_output(ctx, 0);
+
+    listener.diff_data = ctx;
+    listener.read_diff = cb_read_diff_mem;
+    listener.read_old  = cb_read_old;
+    listener.write_new = cb_write_new;
+
+    if (!hpatch_lite_patch(&listener, new_size, mem_plan.patch_buf, mem_plan.patch_cache) ||
+        flush_write_buffer(ctx) != 0) {
+        LOG_ERR("patch error!"); ret = -EIO; goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    patch_mem_release(&mem_plan);
+    return ret;
+}
+#endif
+
+int start_firmware_patch(uint32_t package_size, const journal_record_t *resume,
+                         uint32_t *out_new_size, uint32_t *out_new_crc) {
     struct ota_custom_header header;
     hpatchi_listener_t listener = {0};
     hpi_compressType compress_type = kCompressType_no;
     
-    // define pointer, all use heap
+    // contexts and buffers all live in the arena patch region
     struct patch_ctx* p_main_ctx = NULL;
-    tuz_adapter_ctx_t* p_tuz_ctx = NULL;
+    decomp_stream_t* p_dec = NULL;
     uint8_t* p_temp_cache = NULL;
+    patch_mem_plan_t mem_plan = {0};
     
     hpi_TInputStreamHandle final_diff_handle = NULL;
     hpi_TInputStream_read  final_diff_read   = NULL;
@@ -170,27 +320,34 @@ int start_firmware_patch(uint32_t *out_new_size, uint32_t *out_new_crc) {
     hpi_pos_t alg_uncompress_size = 0;
     int ret = -EFTYPE;
 
-    p_main_ctx = k_malloc(sizeof(struct patch_ctx));
-    if (!p_main_ctx) { LOG_ERR("om: main ctx"); return -ENOMEM; }
+    mem_arena_enter(MEM_PHASE_PATCH);
+    mem_patch_t *mem = mem_arena_patch();
+    p_main_ctx = &mem->ctx;
     memset(p_main_ctx, 0, sizeof(struct patch_ctx));
 
-    // open the partition
-    if (flash_area_open(FIXED_PARTITION_ID(application), &p_main_ctx->fa_old) != 0 ||
-        flash_area_open(FIXED_PARTITION_ID(download_partition), &p_main_ctx->fa_diff) != 0 ||
-        flash_area_open(FIXED_PARTITION_ID(diff_fw_partition), &p_main_ctx->fa_new) != 0) {
+    p_main_ctx->fa_diff = partition_get(PART_DOWNLOAD);
+    p_main_ctx->fa_new = partition_get(PART_DIFF_FW);
+    if (!p_main_ctx->fa_diff || !p_main_ctx->fa_new) {
         LOG_ERR("faild to open flash partitions");
         ret = -ENODEV; goto cleanup;
     }
 
     // read header
     flash_area_read(p_main_ctx->fa_diff, 0, &header, sizeof(header));
-    if (memcmp(header.magic, "DOTA", sizeof(header.magic)) == 0) {
+    if (memcmp(header.magic, DIFF_PACKAGE_MAGIC, sizeof(header.magic)) == 0) {
         LOG_WRN("parse package magic header: %s, select diff update", header.magic);
     } else {
         LOG_WRN("parse package magic header: %s, select full update", header.magic);
         ret = FULL_PACKAGE_FLAG; goto cleanup;
     }
 
+    // nothing is erased until a base image matching the package is found
+    p_main_ctx->fa_old = select_patch_base(header.base_size, header.base_crc);
+    if (!p_main_ctx->fa_old) {
+        LOG_ERR("no base image matches size %u, crc 0x%08x", header.base_size, header.base_crc);
+        ret = -ENOENT; goto cleanup;
+    }
+
     p_main_ctx->read_diff_offset = sizeof(header);
 
     // open patch
@@ -200,59 +357,114 @@ int start_firmware_patch(uint32_t *out_new_size, uint32_t *out_new_crc) {
 
     uint32_t final_new_size = (uint32_t)(alg_new_size & 0xFFFFFFFF);
     LOG_INF("hpatch open, size: %u, type: %d", final_new_size, compress_type);
+    uint32_t patch_start_ms = k_uptime_get_32();
+    uint32_t patch_start = bl_stats_start();
+    bl_trace(BL_TRACE_PATCH_BEGIN, compress_type, final_new_size, 0);
 
-    if (compress_type == kCompressType_tuz) {
-        LOG_INF("type: tinyuz");
-        
-        p_tuz_ctx = k_malloc(sizeof(tuz_adapter_ctx_t));
-        if (!p_tuz_ctx) { LOG_ERR("oom: tuz ctx"); ret = -ENOMEM; goto cleanup; }
-        memset(p_tuz_ctx, 0, sizeof(tuz_adapter_ctx_t));
+    if (resume && (resume->new_size != final_new_size || resume->new_crc != header.new_crc)) {
+        LOG_ERR("journal does not match the package in the download slot");
+        ret = -ESTALE; goto cleanup;
+    }
+    p_main_ctx->journal_size = final_new_size;
+    p_main_ctx->journal_crc = header.new_crc;
+
+#ifdef CONFIG_BL_PATCH_INRAM
+    if (!resume && package_size > p_main_ctx->read_diff_offset) {
+        ret = patch_from_ram(p_main_ctx, compress_type, package_size - p_main_ctx->read_diff_offset,
+                             alg_uncompress_size, alg_new_size);
+        if (ret != -ENOMEM) {
+            if (ret == 0) {
+                LOG_INF("patch success!");
+                *out_new_size = final_new_size;
+                *out_new_crc = header.new_crc;
+            }
+            LOG_INF("patch path in-ram, %u ms", k_uptime_get_32() - patch_start_ms);
+            bl_stats_stop(BL_STAT_PATCH, final_new_size, patch_start);
+            bl_trace(BL_TRACE_PATCH_END, ret, final_new_size, 0);
+            goto cleanup;
+        }
+    }
+#endif
 
-        p_tuz_ctx->raw_stream_handle = (hpi_TInputStreamHandle)p_main_ctx; 
-        p_tuz_ctx->raw_read_cb       = hpi_read_diff_adapter;      
+    if (compress_type != kCompressType_no) {
+        p_dec = &mem->dec;
 
-        // skip 4 byte header
-        uint8_t dummy[4]; hpi_size_t dummy_len = 4;
-        if (!p_tuz_ctx->raw_read_cb(p_tuz_ctx->raw_stream_handle, dummy, &dummy_len)) { ret = -EIO; goto cleanup; }
-        LOG_INF("skip header: %02x %02x %02x %02x", dummy[0], dummy[1], dummy[2], dummy[3]);
+        ret = decomp_init(p_dec, compress_type, (hpi_TInputStreamHandle)p_main_ctx, hpi_read_diff_adapter);
+        if (ret != 0) goto cleanup;
+        LOG_INF("type: %s", p_dec->codec->name);
 
-        tuz_size_t dict_size = 4096;
-        tuz_size_t cache_size = 1024; 
-        
-        p_tuz_ctx->dec_buffer = k_malloc(dict_size + cache_size);
-        if (!p_tuz_ctx->dec_buffer) { LOG_ERR("oom: tuz buffer"); ret = -ENOMEM; goto cleanup; }
+        uint32_t window_size = 0;
+        ret = decomp_window_size(p_dec, &window_size);
+        if (ret != 0) goto cleanup;
+        LOG_INF("%s window size: %u", p_dec->codec->name, window_size);
+#ifdef CONFIG_BL_PATCH_PIPELINE
+        // from here on the code stream comes from the read-ahead stage
+        p_dec->raw_read = pipe_read_diff_cb;
+#endif
 
-        if (tuz_TStream_open(&p_tuz_ctx->tuz_stream, (tuz_TInputStreamHandle)p_tuz_ctx, 
-                           _tuz_read_code_cb, p_tuz_ctx->dec_buffer, dict_size, cache_size) != tuz_OK) {
-            LOG_ERR("tinyuz open error"); ret = -EIO; goto cleanup;
-        }
+        // rejected here when it can not fit, nothing has been erased yet
+        ret = patch_mem_plan(&mem_plan, window_size);
+        if (ret != 0) goto cleanup;
 
-        final_diff_handle = (hpi_TInputStreamHandle)p_tuz_ctx;
-        final_diff_read   = _hpi_tuz_read_adapter;
+        ret = decomp_open(p_dec, mem_plan.dict_buf, window_size, mem_plan.code_cache);
+        if (ret != 0) goto cleanup;
+
+        final_diff_handle = (hpi_TInputStreamHandle)p_dec;
+        final_diff_read   = _hpi_decomp_read_adapter;
     } else {
         final_diff_handle = (hpi_TInputStreamHandle)p_main_ctx;
         final_diff_read   = hpi_read_diff_adapter;
+
+        ret = patch_mem_plan(&mem_plan, 0);
+        if (ret != 0) goto cleanup;
     }
 
-    LOG_INF("eraseing backup partition...");
-    flash_area_erase(p_main_ctx->fa_new, 0, p_main_ctx->fa_new->fa_size);
-    p_main_ctx->write_addr_offset = 0;
+    prepare_patch_output(p_main_ctx, resume ? resume->progress : 0);
     
     listener.diff_data = final_diff_handle;  
     listener.read_diff = final_diff_read;    
-    if (compress_type == kCompressType_tuz) {
-        LOG_INF("using tinyuz mode");
-        listener.read_old  = cb_read_old_tuz;
-        listener.write_new = cb_write_new_tuz;
+    if (compress_type != kCompressType_no) {
+        listener.read_old  = cb_read_old_dec;
+        listener.write_new = cb_write_new_dec;
     } else {
         listener.read_old  = cb_read_old;
         listener.write_new = cb_write_new;
     }  
 
-    p_temp_cache = k_malloc(4096);
-    if (!p_temp_cache) { ret = -ENOMEM; goto cleanup; }
+    p_temp_cache = mem_plan.patch_buf;
+
+#ifdef CONFIG_BL_PATCH_PIPELINE
+    listener.diff_data = p_main_ctx;
+    listener.read_diff = (compress_type != kCompressType_no) ? pipe_read_code_cb : pipe_read_diff_cb;
+    listener.read_old  = cb_read_old;
+    listener.write_new = cb_write_new_pipe;
 
-    if (hpatch_lite_patch(&listener, (hpi_pos_t)final_new_size, p_temp_cache, 4096)) {
+    patch_pipe_start(p_main_ctx->fa_diff, p_main_ctx->read_diff_offset, p_main_ctx->fa_new,
+                     p_main_ctx->write_addr_offset, pipe_progress_cb, p_main_ctx);
+    if (compress_type != kCompressType_no)
+        patch_pipe_decoder_start(decomp_read, p_dec);
+
+    hpi_BOOL patched = hpatch_lite_patch(&listener, (hpi_pos_t)final_new_size, p_temp_cache, mem_plan.patch_cache);
+    uint32_t piped = 0;
+    ret = patch_pipe_finish(patched, &piped);
+    p_main_ctx->write_addr_offset += piped;
+    if (ret != 0) {
+        LOG_ERR("patch pipeline error!");
+        ret = -EIO;
+    } else if (patched) {
+        LOG_INF("patch success!");
+        *out_new_size = final_new_size;
+        *out_new_crc = header.new_crc;
+        ret = 0;
+    } else {
+        LOG_ERR("patch error!");
+        ret = -EIO;
+    }
+    LOG_INF("patch path pipeline, %u ms", k_uptime_get_32() - patch_start_ms);
+    bl_stats_stop(BL_STAT_PATCH, final_new_size, patch_start);
+    bl_trace(BL_TRACE_PATCH_END, ret, final_new_size, 0);
+#else
+    if (hpatch_lite_patch(&listener, (hpi_pos_t)final_new_size, p_temp_cache, mem_plan.patch_cache)) {
         if (flush_write_buffer(p_main_ctx) != 0) {
             ret = -EIO;
         } else {
@@ -265,70 +477,84 @@ int start_firmware_patch(uint32_t *out_new_size, uint32_t *out_new_crc) {
         LOG_ERR("patch error!");
         ret = -EIO;
     }
+    LOG_INF("patch path stream, %u ms", k_uptime_get_32() - patch_start_ms);
+    bl_stats_stop(BL_STAT_PATCH, final_new_size, patch_start);
+    bl_trace(BL_TRACE_PATCH_END, ret, final_new_size, 0);
+#endif
 
 cleanup:
-    if (p_temp_cache) k_free(p_temp_cache);
-    if (p_tuz_ctx) {if (p_tuz_ctx->dec_buffer) k_free(p_tuz_ctx->dec_buffer); k_free(p_tuz_ctx);}
-    if (p_main_ctx) {
-        if (p_main_ctx->fa_old) flash_area_close(p_main_ctx->fa_old);
-        if (p_main_ctx->fa_diff) flash_area_close(p_main_ctx->fa_diff);
-        if (p_main_ctx->fa_new) flash_area_close(p_main_ctx->fa_new);
-        k_free(p_main_ctx);
-    }
+    patch_mem_release(&mem_plan);
     return ret;
 }
 
-int flash_copy_to_internal(size_t new_fw_size) {
-    const struct flash_area *fa_ext = NULL;
-    const struct flash_area *fa_int = NULL;
+/* copied is a checkpoint on an internal sector boundary, the sectors before it are kept */
+int flash_copy_to_internal(size_t new_fw_size, uint32_t new_crc, uint32_t copied) {
+    const struct flash_area *fa_ext = partition_get(PART_DIFF_FW);
+    const struct flash_area *fa_int = partition_get(PART_APPLICATION);
+    const struct device *dev;
+    struct flash_pages_info info;
     int ret = 0;
 
-    flash_area_open(FIXED_PARTITION_ID(diff_fw_partition), &fa_ext);
-    flash_area_open(FIXED_PARTITION_ID(application), &fa_int);
-
-    LOG_INF("erasing internal app flash...");
-    flash_area_erase(fa_int, 0, fa_int->fa_size);
+    if (!fa_ext || !fa_int) return -ENODEV;
+    dev = flash_area_get_device(fa_int);
 
-    uint8_t *copy_buf = k_malloc(4096);
-    if (!copy_buf) {
-        ret = -ENOMEM;
-        goto exit;
+    if (copied == 0) {
+        LOG_INF("erasing internal app flash...");
+    } else {
+        LOG_WRN("resume internal copy at 0x%x", copied);
     }
+    bl_flash_area_erase(fa_int, copied, fa_int->fa_size - copied);
+
+    mem_arena_enter(MEM_PHASE_COPY);
+    uint8_t *copy_buf = mem_arena_page();
 
-    uint32_t processed = 0;
+    uint32_t processed = copied;
+    uint32_t sector_end = 0;
     while (processed < new_fw_size) {
+        if (processed >= sector_end) {
+            if (flash_get_page_info_by_offs(dev, fa_int->fa_off + processed, &info) != 0) {
+                ret = -EIO;
+                break;
+            }
+            sector_end = info.start_offset + info.size - fa_int->fa_off;
+        }
+
         uint32_t chunk = (new_fw_size - processed > 4096) ? 4096 : (new_fw_size - processed);
+        uint32_t start = bl_stats_start();
         flash_area_read(fa_ext, processed, copy_buf, chunk);
-        flash_area_write(fa_int, processed, copy_buf, chunk);
+        bl_stats_stop(BL_STAT_NOR_READ, chunk, start);
+        bl_flash_area_write(fa_int, processed, copy_buf, chunk);
         processed += chunk;
         if (processed % (32 * 1024) == 0) {
             LOG_INF("internal copy: %d / %d", processed, (uint32_t)new_fw_size);
+            bl_job_progress(BL_JOB_PHASE_COPY, processed, new_fw_size);
+        }
+        if (processed == sector_end && processed < new_fw_size) {
+            bl_trace(BL_TRACE_COPY_CHECKPOINT, 0, processed, new_fw_size);
+            nor_journal_append(JOURNAL_COPY, new_fw_size, new_crc, processed);
         }
     }
-    k_free(copy_buf);
 
-exit:
-    flash_area_close(fa_ext);
-    flash_area_close(fa_int);
     return ret;
 }
 
 int verify_internal_firmware(uint32_t fw_size, uint32_t crc) {
-    const struct flash_area *fa_int;
+    const struct flash_area *fa_int = partition_get(PART_APPLICATION);
     uint32_t ccrc = 0;
     uint8_t verify_buf[1024];
     uint32_t offset = 0;
 
-    flash_area_open(FIXED_PARTITION_ID(application), &fa_int);
+    if (!fa_int) return -ENODEV;
     LOG_INF("verifying internal firmware crc...");
 
+    uint32_t start = bl_stats_start();
     while (offset < fw_size) {
         uint32_t len = (fw_size - offset > sizeof(verify_buf)) ? sizeof(verify_buf) : (fw_size - offset);
         flash_area_read(fa_int, offset, verify_buf, len);
         ccrc = crc32_ieee_update(ccrc, verify_buf, len);
         offset += len;
     }
-    flash_area_close(fa_int);
+    bl_stats_stop(BL_STAT_CRC, fw_size, start);
 
     if (ccrc == crc) {
         LOG_INF("verify success 0x%08X", ccrc);
@@ -338,17 +564,16 @@ int verify_internal_firmware(uint32_t fw_size, uint32_t crc) {
     return -EFAULT;
 }
 
-int ota_update_task(void) {
-    uint32_t restored_size = 0;
-    uint32_t restored_crc = 0;
+static int install_patched_image(uint32_t restored_size, uint32_t restored_crc, uint32_t copied,
+                                 bool *keep_journal) {
     int ret;
 
-    LOG_INF("check diff or full package...");
+    if (copied == 0)
+        nor_journal_append(JOURNAL_COPY, restored_size, restored_crc, 0);
 
-    ret = start_firmware_patch(&restored_size, &restored_crc);
-    if (ret != 0) return ret;
-
-    ret = flash_copy_to_internal(restored_size);
+    uint32_t start = bl_stats_start();
+    ret = flash_copy_to_internal(restored_size, restored_crc, copied);
+    bl_stats_stop(BL_STAT_COPY, restored_size - copied, start);
     if (ret != 0) return ret;
 
     ret = verify_internal_firmware(restored_size, restored_crc);
@@ -356,12 +581,69 @@ int ota_update_task(void) {
         return ret;
     }
 
+    // the journal stays in COPY, a resume copies again and retries the arg info
     if (!bl_diff_info_copy(restored_size, restored_crc)) {
-        LOG_INF("diff package info program err");
-        return ret;
+        LOG_ERR("diff package info program err");
+        *keep_journal = true;
+        return -EIO;
     }
 
     LOG_INF("diff package update success!");
 
+    return ret;
+}
+
+int ota_update_task(uint32_t package_size) {
+    uint32_t restored_size = 0;
+    uint32_t restored_crc = 0;
+    bool keep_journal = false;
+    int ret;
+
+    LOG_INF("check diff or full package...");
+
+    ret = start_firmware_patch(package_size, NULL, &restored_size, &restored_crc);
+    if (ret == 0)
+        ret = install_patched_image(restored_size, restored_crc, 0, &keep_journal);
+
+    // a failed update is not resumed at the next boot
+    if (ret != 0 && ret != FULL_PACKAGE_FLAG && !keep_journal)
+        nor_journal_append(JOURNAL_IDLE, 0, 0, 0);
+    return ret;
+}
+
+/*
+ * Picks up a diff update cut by power loss from its last journal checkpoint.
+ * Returns 0 once the image is installed, -ENOENT when nothing is in flight.
+ */
+int ota_resume_task(void) {
+    journal_record_t rec;
+    uint32_t restored_size = 0;
+    uint32_t restored_crc = 0;
+    bool keep_journal = false;
+    int ret;
+
+    if (!nor_journal_last(&rec) || rec.phase == JOURNAL_IDLE)
+        return -ENOENT;
+
+    if (rec.phase == JOURNAL_PATCH) {
+        LOG_WRN("diff patch interrupted at 0x%x, resuming", rec.progress);
+        ret = start_firmware_patch(0, &rec, &restored_size, &restored_crc);
+        if (ret == 0)
+            ret = install_patched_image(restored_size, restored_crc, 0, &keep_journal);
+    } else if (rec.phase == JOURNAL_COPY) {
+        LOG_WRN("internal copy interrupted at 0x%x, resuming", rec.progress);
+        ret = install_patched_image(rec.new_size, rec.new_crc, rec.progress, &keep_journal);
+    } else if (rec.phase == JOURNAL_PROMOTE) {
+        LOG_WRN("slot promotion interrupted, image 0x%08x already installed", rec.new_crc);
+        ret = 0;
+    } else {
+        ret = -EINVAL;
+    }
+
+    if (ret != 0) {
+        LOG_ERR("update resume faild, ret %d", ret);
+        if (!keep_journal)
+            nor_journal_append(JOURNAL_IDLE, 0, 0, 0);
+    }
     return ret;
 }
\ No newline at end of file
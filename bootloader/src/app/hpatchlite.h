@@ -1,9 +1,34 @@
 #ifndef __HPATCHLITE_H
 #define __HPATCHLITE_H
 
-int ota_update_task(void);
+#include <stdint.h>
+
+struct flash_area;
+
+#define WRITE_BUF_SIZE 256
+
+/* lives in the patch region of the phase arena */
+struct patch_ctx {
+    const struct flash_area *fa_old;
+    const struct flash_area *fa_diff;
+    const struct flash_area *fa_new;
+    uint32_t write_addr_offset;
+    uint32_t read_diff_offset;
+    const uint8_t *diff_mem;    // whole diff in RAM, read_diff_offset indexes it
+    uint32_t diff_mem_size;
+    uint32_t skip_len;          // output already in the diff slot when resuming
+    uint32_t journal_size;      // image the checkpoints belong to
+    uint32_t journal_crc;
+    
+    uint8_t  write_buf[WRITE_BUF_SIZE];
+    uint16_t buf_fill;
+};
+
+int ota_update_task(uint32_t package_size);
+int ota_resume_task(void);
 
 #define FULL_PACKAGE_FLAG 99
 #define DIFF_PACKAGE_FLAG 0
+#define DIFF_PACKAGE_MAGIC "DOTA"
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <string.h>
+#include "lz4_dec.h"
+
+#define LZ4_MIN_MATCH           4
+#define LZ4_RUN_MASK            15
+#define LZ4_RAW_BLOCK           0x80000000U
+
+#define LZ4_MIN(a, b)           ((a) < (b) ? (a) : (b))
+
+static int cache_fill(lz4_dec_t *dec)
+{
+    uint32_t len = dec->cache_size;
+
+    if (!dec->read(dec->handle, dec->cache, &len) || len == 0)
+        return -EIO;
+
+    dec->cache_begin = 0;
+    dec->cache_end = len;
+    return 0;
+}
+
+static int read_bytes(lz4_dec_t *dec, uint8_t *dst, uint32_t len)
+{
+    while (len > 0) {
+        if (dec->cache_begin == dec->cache_end && cache_fill(dec) != 0)
+            return -EIO;
+
+        uint32_t n = LZ4_MIN(len, dec->cache_end - dec->cache_begin);
+        memcpy(dst, dec->cache + dec->cache_begin, n);
+        dec->cache_begin += n;
+        dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_byte(lz4_dec_t *dec, uint8_t *v)
+{
+    if (dec->cache_begin == dec->cache_end && cache_fill(dec) != 0)
+        return -EIO;
+
+    *v = dec->cache[dec->cache_begin++];
+    return 0;
+}
+
+static int read_u32(lz4_dec_t *dec, uint32_t *v)
+{
+    uint8_t b[4];
+
+    if (read_bytes(dec, b, sizeof(b)) != 0)
+        return -EIO;
+
+    *v = b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+    return 0;
+}
+
+/* 255 bytes continue a run length, in_left bounds it to the block */
+static int read_run(lz4_dec_t *dec, uint32_t *len, uint32_t *in_left)
+{
+    uint8_t b;
+
+    do {
+        if (*in_left == 0)
+            return -EBADMSG;
+        if (read_byte(dec, &b) != 0)
+            return -EIO;
+        (*in_left)--;
+        *len += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+static int decode_block(lz4_dec_t *dec, uint32_t in_left)
+{
+    uint8_t *out = dec->block;
+    uint32_t pos = 0;
+    int ret;
+
+    while (in_left > 0) {
+        uint8_t token;
+        if (read_byte(dec, &token) != 0)
+            return -EIO;
+        in_left--;
+
+        uint32_t lit = token >> 4;
+        if (lit == LZ4_RUN_MASK && (ret = read_run(dec, &lit, &in_left)) != 0)
+            return ret;
+        if (lit > in_left || lit > dec->block_size - pos)
+            return -EBADMSG;
+        if (read_bytes(dec, out + pos, lit) != 0)
+            return -EIO;
+        pos += lit;
+        in_left -= lit;
+
+        // the last sequence of a block carries literals only
+        if (in_left == 0)
+            break;
+
+        uint8_t off[2];
+        if (in_left < sizeof(off))
+            return -EBADMSG;
+        if (read_bytes(dec, off, sizeof(off)) != 0)
+            return -EIO;
+        in_left -= sizeof(off);
+
+        uint32_t offset = off[0] | ((uint32_t)off[1] << 8);
+        if (offset == 0 || offset > pos)
+            return -EBADMSG;
+
+        uint32_t match = token & LZ4_RUN_MASK;
+        if (match == LZ4_RUN_MASK && (ret = read_run(dec, &match, &in_left)) != 0)
+            return ret;
+        match += LZ4_MIN_MATCH;
+        if (match > dec->block_size - pos)
+            return -EBADMSG;
+
+        uint8_t *dst = out + pos;
+        if (offset >= match) {
+            memcpy(dst, dst - offset, match);
+        } else {
+            // overlapping match, the copied run doubles and stays a multiple of offset
+            uint32_t step = offset;
+            uint32_t left = match;
+            while (left > 0) {
+                uint32_t n = LZ4_MIN(step, left);
+                memcpy(dst, dst - step, n);
+                dst += n;
+                left -= n;
+                step += step;
+            }
+        }
+        pos += match;
+    }
+
+    dec->block_len = pos;
+    dec->block_pos = 0;
+    return 0;
+}
+
+static int next_block(lz4_dec_t *dec)
+{
+    uint32_t word;
+
+    if (read_u32(dec, &word) != 0)
+        return -EIO;
+
+    dec->block_len = 0;
+    dec->block_pos = 0;
+    if (word == 0) {
+        dec->end = true;
+        return 0;
+    }
+
+    uint32_t len = word & ~LZ4_RAW_BLOCK;
+    if (word & LZ4_RAW_BLOCK) {
+        if (len > dec->block_size)
+            return -EBADMSG;
+        if (read_bytes(dec, dec->block, len) != 0)
+            return -EIO;
+        dec->block_len = len;
+        return 0;
+    }
+
+    return decode_block(dec, len);
+}
+
+uint32_t lz4_dec_read_block_size(void *handle, lz4_read_t read)
+{
+    uint8_t b[4];
+    uint32_t len = sizeof(b);
+
+    if (!read(handle, b, &len) || len != sizeof(b))
+        return 0;
+
+    return b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+int lz4_dec_open(lz4_dec_t *dec, void *handle, lz4_read_t read,
+                 uint8_t *block_and_cache, uint32_t block_size, uint32_t cache_size)
+{
+    if (block_size == 0 || cache_size == 0)
+        return -EINVAL;
+
+    memset(dec, 0, sizeof(*dec));
+    dec->handle = handle;
+    dec->read = read;
+    dec->block = block_and_cache;
+    dec->block_size = block_size;
+    dec->cache = block_and_cache + block_size;
+    dec->cache_size = cache_size;
+    return 0;
+}
+
+int lz4_dec_read(lz4_dec_t *dec, uint8_t *out, uint32_t *size)
+{
+    uint32_t done = 0;
+    int ret = 0;
+
+    while (done < *size) {
+        if (dec->block_pos == dec->block_len) {
+            if (dec->end)
+                break;
+            ret = next_block(dec);
+            if (ret != 0)
+                break;
+            continue;
+        }
+
+        uint32_t n = LZ4_MIN(*size - done, dec->block_len - dec->block_pos);
+        memcpy(out + done, dec->block + dec->block_pos, n);
+        dec->block_pos += n;
+        done += n;
+    }
+
+    *size = done;
+    if (ret != 0)
+        return ret;
+    return (dec->end && dec->block_pos == dec->block_len) ? 1 : 0;
+}
@@ -0,0 +1,39 @@
+#ifndef __LZ4_DEC_H
+#define __LZ4_DEC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * LZ4 stream as packed into diff packages:
+ *   u32 LE  block size, the largest decoded size of one block
+ *   blocks  u32 LE length then data, same as the LZ4 frame block layout:
+ *           bit31 set stores the block raw, otherwise it is one LZ4 block
+ *           compressed independently of the others
+ *   u32 0   end mark
+ * Frame descriptor and checksums are dropped, the package crc covers them.
+ */
+typedef bool (*lz4_read_t)(void *handle, uint8_t *buf, uint32_t *size);
+
+typedef struct
+{
+    void *handle;
+    lz4_read_t read;
+    uint8_t *block;         // block_size decoded bytes
+    uint32_t block_size;
+    uint32_t block_len;     // decoded length of the current block
+    uint32_t block_pos;     // bytes already handed out
+    uint8_t *cache;         // input cache, follows the block buffer
+    uint32_t cache_size;
+    uint32_t cache_begin;
+    uint32_t cache_end;
+    bool end;
+} lz4_dec_t;
+
+uint32_t lz4_dec_read_block_size(void *handle, lz4_read_t read);
+int lz4_dec_open(lz4_dec_t *dec, void *handle, lz4_read_t read,
+                 uint8_t *block_and_cache, uint32_t block_size, uint32_t cache_size);
+/* return 0 while data follows, 1 at end of stream, negative on error */
+int lz4_dec_read(lz4_dec_t *dec, uint8_t *out, uint32_t *size);
+
+#endif
@@ -0,0 +1,78 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include "mem_arena.h"
+
+LOG_MODULE_REGISTER(mem_arena, CONFIG_LOG_DEFAULT_LEVEL);
+
+#ifdef CONFIG_BL_MEM_ARENA_CCM
+#define MEM_ARENA_SECTION   __ccm_noinit_section
+#else
+#define MEM_ARENA_SECTION   __noinit
+#endif
+
+typedef struct
+{
+    uint8_t page[MEM_PAGE_SIZE];
+    union {
+        mem_transfer_t transfer;
+        mem_patch_t patch;
+        mem_copy_t copy;
+    } phase;
+} mem_arena_t;
+
+/* mem_report.py looks both up in the elf */
+static mem_arena_t mem_arena __aligned(8) MEM_ARENA_SECTION;
+static const uint32_t mem_arena_phase_size[MEM_PHASE_COUNT] = {
+    [MEM_PHASE_IDLE]     = 0,
+    [MEM_PHASE_TRANSFER] = sizeof(mem_transfer_t),
+    [MEM_PHASE_PATCH]    = sizeof(mem_patch_t),
+    [MEM_PHASE_COPY]     = sizeof(mem_copy_t),
+};
+
+static mem_phase_t current;
+static K_MUTEX_DEFINE(arena_lock);
+
+void mem_arena_enter(mem_phase_t phase)
+{
+    k_mutex_lock(&arena_lock, K_FOREVER);
+    if (current != phase) {
+        LOG_INF("arena phase %d -> %d, %u of %u bytes", current, phase,
+                mem_arena_phase_size[phase], (uint32_t)sizeof(mem_arena.phase));
+        current = phase;
+    }
+    k_mutex_unlock(&arena_lock);
+}
+
+mem_phase_t mem_arena_hold(void)
+{
+    k_mutex_lock(&arena_lock, K_FOREVER);
+    return current;
+}
+
+void mem_arena_release(void)
+{
+    k_mutex_unlock(&arena_lock);
+}
+
+uint8_t *mem_arena_page(void)
+{
+    return mem_arena.page;
+}
+
+mem_transfer_t *mem_arena_transfer(void)
+{
+    __ASSERT(current == MEM_PHASE_TRANSFER, "arena is in phase %d", current);
+    return &mem_arena.phase.transfer;
+}
+
+mem_patch_t *mem_arena_patch(void)
+{
+    __ASSERT(current == MEM_PHASE_PATCH, "arena is in phase %d", current);
+    return &mem_arena.phase.patch;
+}
+
+mem_copy_t *mem_arena_copy(void)
+{
+    __ASSERT(current == MEM_PHASE_COPY, "arena is in phase %d", current);
+    return &mem_arena.phase.copy;
+}
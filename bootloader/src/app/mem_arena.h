@@ -0,0 +1,63 @@
+#ifndef __MEM_ARENA_H
+#define __MEM_ARENA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hpatchlite.h"
+#include "decomp.h"
+#ifdef CONFIG_BL_PATCH_PIPELINE
+#include "patch_pipe.h"
+#endif
+
+/*
+ * All upgrade buffers are one static arena, sized at build time. The page
+ * is scratch for the flash leaf routines of any phase, the phase regions
+ * overlap: entering a phase hands its region over and whatever the previous
+ * phase left there is gone. mem_report.py prints the peak RAM per phase
+ * after the link.
+ */
+#define MEM_PAGE_SIZE           4096
+#define MEM_REQUEST_SIZE        5112    // one request frame, header + MTU + crc
+
+typedef enum
+{
+    MEM_PHASE_IDLE,         // nothing handed out
+    MEM_PHASE_TRANSFER,     // uart request frames, PROGRAM data included
+    MEM_PHASE_PATCH,        // diff patch
+    MEM_PHASE_COPY,         // image copies to internal flash and the archive
+    MEM_PHASE_COUNT
+} mem_phase_t;
+
+typedef struct
+{
+    uint8_t request[MEM_REQUEST_SIZE];
+} mem_transfer_t;
+
+typedef struct
+{
+    struct patch_ctx ctx;
+    decomp_stream_t dec;
+    uint8_t pool[CONFIG_BL_PATCH_CCM_POOL_SIZE] __aligned(4);  // decoder window and caches, see mem_plan
+#ifdef CONFIG_BL_PATCH_PIPELINE
+    uint8_t pipe_diff[PIPE_DIFF_SIZE];
+    uint8_t pipe_code[PIPE_CODE_SIZE];
+    uint8_t pipe_out[PIPE_OUT_SIZE];
+#endif
+} mem_patch_t;
+
+typedef struct
+{
+    uint8_t archive_block[MEM_PAGE_SIZE];
+} mem_copy_t;
+
+void mem_arena_enter(mem_phase_t phase);
+/* keeps the arena in its current phase until mem_arena_release() */
+mem_phase_t mem_arena_hold(void);
+void mem_arena_release(void);
+
+uint8_t *mem_arena_page(void);
+mem_transfer_t *mem_arena_transfer(void);
+mem_patch_t *mem_arena_patch(void);
+mem_copy_t *mem_arena_copy(void);
+
+#endif
@@ -0,0 +1,77 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+#include "mem_plan.h"
+#include "mem_arena.h"
+
+LOG_MODULE_REGISTER(mem_plan, CONFIG_LOG_DEFAULT_LEVEL);
+
+#define CODE_CACHE_MAX          1024
+#define CODE_CACHE_MIN          64
+#define PATCH_CACHE_MAX         4096
+#define PATCH_CACHE_MIN         256
+
+static bool pool_busy;
+
+/* shrink the caches until dictionary and caches fit the budget */
+static bool plan_fit(patch_mem_plan_t *plan, uint32_t budget, bool need_code_cache)
+{
+    // dict_size comes from the package header, compared by subtraction so it cannot wrap the sum
+    if (plan->dict_size > budget)
+        return false;
+
+    plan->code_cache = (plan->dict_size && need_code_cache) ? CODE_CACHE_MAX : 0;
+    plan->patch_cache = PATCH_CACHE_MAX;
+
+    while (plan->code_cache + plan->patch_cache > budget - plan->dict_size) {
+        if (plan->patch_cache > PATCH_CACHE_MIN && plan->patch_cache >= plan->code_cache) {
+            plan->patch_cache /= 2;
+        } else if (plan->code_cache > CODE_CACHE_MIN) {
+            plan->code_cache /= 2;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int plan_alloc(patch_mem_plan_t *plan, uint32_t dict_size, bool need_code_cache)
+{
+    uint8_t *pool = mem_arena_patch()->pool;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->dict_size = dict_size;
+
+    if (pool_busy || !plan_fit(plan, CONFIG_BL_PATCH_CCM_POOL_SIZE - 4, need_code_cache)) {
+        LOG_ERR("package dict %u exceeds patch pool", dict_size);
+        return -ENOMEM;
+    }
+
+    uint32_t dict_len = ROUND_UP(plan->dict_size + plan->code_cache, 4);
+
+    pool_busy = true;
+    plan->dict_buf = plan->dict_size ? pool : NULL;
+    plan->patch_buf = pool + dict_len;
+
+    LOG_INF("patch memory: dict %u, code cache %u, patch cache %u", plan->dict_size,
+            plan->code_cache, plan->patch_cache);
+    return 0;
+}
+
+int patch_mem_plan(patch_mem_plan_t *plan, uint32_t dict_size)
+{
+    return plan_alloc(plan, dict_size, true);
+}
+
+int patch_mem_plan_inram(patch_mem_plan_t *plan, uint32_t image_size)
+{
+    return plan_alloc(plan, image_size, false);
+}
+
+void patch_mem_release(patch_mem_plan_t *plan)
+{
+    if (plan->patch_buf) {
+        pool_busy = false;
+    }
+    memset(plan, 0, sizeof(*plan));
+}
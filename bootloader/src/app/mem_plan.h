@@ -0,0 +1,25 @@
+#ifndef __MEM_PLAN_H
+#define __MEM_PLAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Buffers needed by one diff patch, sized from the package itself and
+ * carved from the pool of the arena patch region.
+ */
+typedef struct
+{
+    uint32_t dict_size;     // decoder window, 0 for uncompressed diffs
+    uint32_t code_cache;    // decoder input cache, follows the window
+    uint32_t patch_cache;   // hpatch temp cache, split into diff and old-data caches
+    uint8_t *dict_buf;      // dict_size + code_cache bytes
+    uint8_t *patch_buf;     // patch_cache bytes
+} patch_mem_plan_t;
+
+int patch_mem_plan(patch_mem_plan_t *plan, uint32_t dict_size);
+/* whole diff held in dict_buf, no code cache */
+int patch_mem_plan_inram(patch_mem_plan_t *plan, uint32_t image_size);
+void patch_mem_release(patch_mem_plan_t *plan);
+
+#endif
@@ -0,0 +1,366 @@
+#include <zephyr/kernel.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/ring_buffer.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+#include "patch_pipe.h"
+#include "bl_stats.h"
+#include "mem_arena.h"
+
+LOG_MODULE_REGISTER(patch_pipe, CONFIG_LOG_DEFAULT_LEVEL);
+
+#define PIPE_CHUNK_SIZE         256
+#define PIPE_PAGE_SIZE          256     // one norflash page program
+
+typedef struct
+{
+    struct ring_buf ring;
+    struct k_sem data;      // given after put
+    struct k_sem space;     // given after get
+    struct k_spinlock lock;
+    volatile bool closed;   // producer finished, no more put
+} patch_pipe_t;
+
+typedef struct
+{
+    uint32_t start_ms;
+    uint32_t end_ms;
+    uint64_t idle_cyc;
+    uint32_t bytes;
+} pipe_stage_ctx_t;
+
+static patch_pipe_t diff_pipe;
+static patch_pipe_t code_pipe;
+static patch_pipe_t out_pipe;
+
+static K_THREAD_STACK_DEFINE(reader_stack, CONFIG_BL_PATCH_PIPE_STACK_SIZE);
+static K_THREAD_STACK_DEFINE(decoder_stack, CONFIG_BL_PATCH_PIPE_STACK_SIZE);
+static K_THREAD_STACK_DEFINE(writer_stack, CONFIG_BL_PATCH_PIPE_STACK_SIZE);
+static struct k_thread reader_thread;
+static struct k_thread decoder_thread;
+static struct k_thread writer_thread;
+static struct k_thread *const stage_threads[PIPE_STAGE_COUNT] = {
+    [PIPE_STAGE_READ]   = &reader_thread,
+    [PIPE_STAGE_DECODE] = &decoder_thread,
+    [PIPE_STAGE_WRITE]  = &writer_thread,
+};
+static bool stage_started[PIPE_STAGE_COUNT];
+
+static const struct flash_area *fa_src;
+static const struct flash_area *fa_dst;
+static uint32_t src_offset;
+static uint32_t dst_offset;
+static uint32_t dst_written;
+
+static patch_pipe_progress_t progress_cb;
+static void *progress_arg;
+
+static patch_pipe_decode_t decoder;
+static void *decoder_ctx;
+static bool decoder_running;
+
+static volatile bool pipe_abort;
+static volatile int pipe_error;
+static pipe_stage_ctx_t stages[PIPE_STAGE_COUNT];
+
+static const char *const stage_names[PIPE_STAGE_COUNT] = {
+    "read", "decode", "patch", "write"
+};
+
+static void pipe_init(patch_pipe_t *p, uint8_t *buf, uint32_t size)
+{
+    ring_buf_init(&p->ring, size, buf);
+    k_sem_init(&p->data, 0, 1);
+    k_sem_init(&p->space, 0, 1);
+    p->closed = false;
+}
+
+static void pipe_close(patch_pipe_t *p)
+{
+    p->closed = true;
+    k_sem_give(&p->data);
+    k_sem_give(&p->space);
+}
+
+static void pipe_fail(int err)
+{
+    if (pipe_error == 0)
+        pipe_error = err;
+
+    pipe_abort = true;
+    pipe_close(&diff_pipe);
+    pipe_close(&code_pipe);
+    pipe_close(&out_pipe);
+}
+
+static void pipe_wait(struct k_sem *sem, patch_pipe_stage_t stage)
+{
+    uint32_t begin = k_cycle_get_32();
+
+    k_sem_take(sem, K_FOREVER);
+    stages[stage].idle_cyc += k_cycle_get_32() - begin;
+}
+
+static uint32_t pipe_put(patch_pipe_t *p, patch_pipe_stage_t stage, const uint8_t *data, uint32_t size)
+{
+    uint32_t done = 0;
+
+    while (done < size && !pipe_abort) {
+        k_spinlock_key_t key = k_spin_lock(&p->lock);
+        uint32_t len = ring_buf_put(&p->ring, data + done, size - done);
+        k_spin_unlock(&p->lock, key);
+
+        if (len > 0) {
+            done += len;
+            k_sem_give(&p->data);
+            continue;
+        }
+        pipe_wait(&p->space, stage);
+    }
+
+    return done;
+}
+
+/* blocks until size bytes arrived, short only at end of stream */
+static uint32_t pipe_get(patch_pipe_t *p, patch_pipe_stage_t stage, uint8_t *buf, uint32_t size)
+{
+    uint32_t done = 0;
+
+    while (done < size) {
+        // sampled before get, once closed every put has landed in the ring
+        bool closed = p->closed;
+
+        k_spinlock_key_t key = k_spin_lock(&p->lock);
+        uint32_t len = ring_buf_get(&p->ring, buf + done, size - done);
+        k_spin_unlock(&p->lock, key);
+
+        if (len > 0) {
+            done += len;
+            k_sem_give(&p->space);
+            continue;
+        }
+        if (closed || pipe_abort)
+            break;
+        pipe_wait(&p->data, stage);
+    }
+
+    return done;
+}
+
+static void pipe_reader(void *p1, void *p2, void *p3)
+{
+    uint8_t chunk[PIPE_CHUNK_SIZE];
+    uint32_t offset = src_offset;
+
+    // read-ahead is bounded by the pipe, the tail of the slot is only read when needed
+    while (!pipe_abort && offset < fa_src->fa_size) {
+        uint32_t len = MIN(sizeof(chunk), fa_src->fa_size - offset);
+        uint32_t start = bl_stats_start();
+        if (flash_area_read(fa_src, offset, chunk, len) != 0) {
+            LOG_ERR("diff read faild at 0x%x", offset);
+            pipe_fail(-EIO);
+            break;
+        }
+        bl_stats_stop(BL_STAT_NOR_READ, len, start);
+        offset += len;
+
+        if (pipe_put(&diff_pipe, PIPE_STAGE_READ, chunk, len) != len)
+            break;
+        stages[PIPE_STAGE_READ].bytes += len;
+    }
+
+    pipe_close(&diff_pipe);
+    stages[PIPE_STAGE_READ].end_ms = k_uptime_get_32();
+}
+
+static void pipe_decoder(void *p1, void *p2, void *p3)
+{
+    uint8_t chunk[PIPE_CHUNK_SIZE];
+
+    while (!pipe_abort) {
+        uint32_t len = sizeof(chunk);
+        int ret = decoder(decoder_ctx, chunk, &len);
+        if (ret < 0) {
+            LOG_ERR("pipe decode faild, ret %d", ret);
+            pipe_fail(-EIO);
+            break;
+        }
+
+        if (len > 0 && pipe_put(&code_pipe, PIPE_STAGE_DECODE, chunk, len) != len)
+            break;
+        stages[PIPE_STAGE_DECODE].bytes += len;
+
+        if (ret > 0)
+            break;
+    }
+
+    pipe_close(&code_pipe);
+    stages[PIPE_STAGE_DECODE].end_ms = k_uptime_get_32();
+}
+
+static void pipe_writer(void *p1, void *p2, void *p3)
+{
+    uint8_t page[PIPE_PAGE_SIZE];
+
+    while (1) {
+        uint32_t len = pipe_get(&out_pipe, PIPE_STAGE_WRITE, page, sizeof(page));
+        if (len == 0)
+            break;
+
+        // last page is padded with 0xFF, same as flush_write_buffer()
+        if (len < sizeof(page))
+            memset(page + len, 0xFF, sizeof(page) - len);
+
+        uint32_t start = bl_stats_start();
+        if (flash_area_write(fa_dst, dst_offset + dst_written, page, sizeof(page)) != 0) {
+            LOG_ERR("pipe write faild at 0x%x", dst_offset + dst_written);
+            pipe_fail(-EIO);
+            break;
+        }
+        bl_stats_stop(BL_STAT_NOR_PROGRAM, sizeof(page), start);
+        dst_written += len;
+        stages[PIPE_STAGE_WRITE].bytes += len;
+
+        if (progress_cb)
+            progress_cb(progress_arg, dst_offset + dst_written);
+    }
+
+    stages[PIPE_STAGE_WRITE].end_ms = k_uptime_get_32();
+}
+
+int patch_pipe_start(const struct flash_area *fa_diff, uint32_t diff_offset,
+                     const struct flash_area *fa_new, uint32_t new_offset,
+                     patch_pipe_progress_t progress, void *progress_ctx)
+{
+    fa_src = fa_diff;
+    src_offset = diff_offset;
+    fa_dst = fa_new;
+    dst_offset = new_offset;
+    dst_written = 0;
+    progress_cb = progress;
+    progress_arg = progress_ctx;
+    decoder_running = false;
+    pipe_abort = false;
+    pipe_error = 0;
+
+    mem_patch_t *mem = mem_arena_patch();
+
+    pipe_init(&diff_pipe, mem->pipe_diff, sizeof(mem->pipe_diff));
+    pipe_init(&code_pipe, mem->pipe_code, sizeof(mem->pipe_code));
+    pipe_init(&out_pipe, mem->pipe_out, sizeof(mem->pipe_out));
+
+    uint32_t now = k_uptime_get_32();
+    memset(stages, 0, sizeof(stages));
+    for (int i = 0; i < PIPE_STAGE_COUNT; i++)
+        stages[i].start_ms = now;
+
+    k_thread_create(&reader_thread, reader_stack, K_THREAD_STACK_SIZEOF(reader_stack),
+                    pipe_reader, NULL, NULL, NULL, CONFIG_BL_PATCH_PIPE_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(&reader_thread, "pipe_read");
+
+    k_thread_create(&writer_thread, writer_stack, K_THREAD_STACK_SIZEOF(writer_stack),
+                    pipe_writer, NULL, NULL, NULL, CONFIG_BL_PATCH_PIPE_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(&writer_thread, "pipe_write");
+    stage_started[PIPE_STAGE_READ] = true;
+    stage_started[PIPE_STAGE_WRITE] = true;
+
+    return 0;
+}
+
+int patch_pipe_decoder_start(patch_pipe_decode_t decode, void *ctx)
+{
+    decoder = decode;
+    decoder_ctx = ctx;
+    decoder_running = true;
+    stages[PIPE_STAGE_DECODE].start_ms = k_uptime_get_32();
+
+    k_thread_create(&decoder_thread, decoder_stack, K_THREAD_STACK_SIZEOF(decoder_stack),
+                    pipe_decoder, NULL, NULL, NULL, CONFIG_BL_PATCH_PIPE_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(&decoder_thread, "pipe_decode");
+    stage_started[PIPE_STAGE_DECODE] = true;
+
+    return 0;
+}
+
+/* raw diff stream, consumed by the decoder or by the patch for uncompressed diffs */
+bool patch_pipe_read_diff(uint8_t *buf, uint32_t *size)
+{
+    patch_pipe_stage_t stage = decoder_running ? PIPE_STAGE_DECODE : PIPE_STAGE_PATCH;
+
+    *size = pipe_get(&diff_pipe, stage, buf, *size);
+    return pipe_error == 0;
+}
+
+bool patch_pipe_read_code(uint8_t *buf, uint32_t *size)
+{
+    *size = pipe_get(&code_pipe, PIPE_STAGE_PATCH, buf, *size);
+    return pipe_error == 0;
+}
+
+bool patch_pipe_write(const uint8_t *data, uint32_t size)
+{
+    if (pipe_put(&out_pipe, PIPE_STAGE_PATCH, data, size) != size)
+        return false;
+
+    stages[PIPE_STAGE_PATCH].bytes += size;
+    return pipe_error == 0;
+}
+
+int patch_pipe_finish(bool success, uint32_t *written)
+{
+    stages[PIPE_STAGE_PATCH].end_ms = k_uptime_get_32();
+
+    if (success) {
+        // drain the writer first, read-ahead past the end of the diff is dropped
+        pipe_close(&out_pipe);
+        k_thread_join(&writer_thread, K_FOREVER);
+        pipe_abort = true;
+        pipe_close(&diff_pipe);
+        pipe_close(&code_pipe);
+    } else {
+        pipe_fail(-ECANCELED);
+        k_thread_join(&writer_thread, K_FOREVER);
+    }
+
+    k_thread_join(&reader_thread, K_FOREVER);
+    if (decoder_running)
+        k_thread_join(&decoder_thread, K_FOREVER);
+    else
+        stages[PIPE_STAGE_DECODE].end_ms = stages[PIPE_STAGE_DECODE].start_ms;
+    decoder_running = false;
+
+    patch_pipe_stats_t stats[PIPE_STAGE_COUNT];
+    patch_pipe_stats_get(stats);
+    for (int i = 0; i < PIPE_STAGE_COUNT; i++) {
+        LOG_INF("pipe %s: %u byte, busy %u ms, idle %u ms", stage_names[i],
+                stats[i].bytes, stats[i].busy_ms, stats[i].idle_ms);
+    }
+
+    if (written)
+        *written = dst_written;
+    return pipe_error;
+}
+
+void patch_pipe_stats_get(patch_pipe_stats_t *stats)
+{
+    for (int i = 0; i < PIPE_STAGE_COUNT; i++) {
+        uint32_t total = stages[i].end_ms - stages[i].start_ms;
+        uint32_t idle = (uint32_t)(k_cyc_to_us_floor64(stages[i].idle_cyc) / 1000);
+
+        stats[i].bytes = stages[i].bytes;
+        stats[i].idle_ms = idle;
+        stats[i].busy_ms = total > idle ? total - idle : 0;
+    }
+}
+
+/* the patch stage runs in the caller, a stage that never ran reports 0 */
+uint32_t patch_pipe_stack_unused(patch_pipe_stage_t stage)
+{
+    size_t unused = 0;
+
+#ifdef CONFIG_INIT_STACKS
+    if (stage_threads[stage] != NULL && stage_started[stage])
+        k_thread_stack_space_get(stage_threads[stage], &unused);
+#endif
+    return unused;
+}
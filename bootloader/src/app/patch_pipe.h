@@ -0,0 +1,51 @@
+#ifndef __PATCH_PIPE_H
+#define __PATCH_PIPE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct flash_area;
+
+/* ring storage, part of the patch region of the phase arena */
+#define PIPE_DIFF_SIZE          1024
+#define PIPE_CODE_SIZE          1024
+#define PIPE_OUT_SIZE           2048
+
+/*
+ * diff read-ahead -> decompress -> hpatch -> page writer, every stage but
+ * the patch (which runs in the caller) has its own thread, stages are linked
+ * by bounded ring buffers.
+ */
+typedef enum
+{
+    PIPE_STAGE_READ,
+    PIPE_STAGE_DECODE,
+    PIPE_STAGE_PATCH,
+    PIPE_STAGE_WRITE,
+    PIPE_STAGE_COUNT
+} patch_pipe_stage_t;
+
+typedef struct
+{
+    uint32_t bytes;         // bytes produced by the stage
+    uint32_t busy_ms;       // running or blocked on its own I/O
+    uint32_t idle_ms;       // waiting on a neighbour pipe
+} patch_pipe_stats_t;
+
+/* return 0 while data follows, 1 at end of stream, negative on error */
+typedef int (*patch_pipe_decode_t)(void *ctx, uint8_t *out, uint32_t *size);
+/* called by the writer after each page, offset is the end of the data written */
+typedef void (*patch_pipe_progress_t)(void *ctx, uint32_t offset);
+
+int patch_pipe_start(const struct flash_area *fa_diff, uint32_t diff_offset,
+                     const struct flash_area *fa_new, uint32_t new_offset,
+                     patch_pipe_progress_t progress, void *progress_ctx);
+int patch_pipe_decoder_start(patch_pipe_decode_t decode, void *ctx);
+bool patch_pipe_read_diff(uint8_t *buf, uint32_t *size);
+bool patch_pipe_read_code(uint8_t *buf, uint32_t *size);
+bool patch_pipe_write(const uint8_t *data, uint32_t size);
+int patch_pipe_finish(bool success, uint32_t *written);
+void patch_pipe_stats_get(patch_pipe_stats_t *stats);
+uint32_t patch_pipe_stack_unused(patch_pipe_stage_t stage);
+
+#endif
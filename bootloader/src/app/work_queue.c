@@ -4,6 +4,7 @@
 #include <zephyr/sys/printk.h>
 #include <zephyr/sys/ring_buffer.h>
 #include "bl_uart.h"
+#include "mem_arena.h"
 
 #define STACK_SIZE 2048
 #define UART_TEMP_BUF 64
@@ -11,13 +12,28 @@
 K_SEM_DEFINE(pkt_sem, 0, 1);
 K_SEM_DEFINE(rx_data_sem, 0, 1);
 
+#ifndef CONFIG_BL_UART_RAM_RESIDENT
 RING_BUF_DECLARE(uart_ringbuf, 512);
+#endif
 
 extern bool bl_received_handler(uint8_t data);
 extern void bl_print_log(void);
 extern bool bl_pkt_handler(void);
+extern bool bl_frame_nak_flush(void);
 extern void bl_pkt_reset(void);
+extern void bl_pkt_bind(bool transfer);
 
+#ifdef CONFIG_BL_UART_RAM_RESIDENT
+static void upgrade_notify_handler(void)
+{
+    k_sem_give(&rx_data_sem);
+}
+
+static uint32_t upgrade_rx_read(uint8_t *buf, uint32_t size)
+{
+    return bl_upgrade_rx_read(buf, size);
+}
+#else
 static void upgrade_callback_handler(uint8_t data)
 {
     if (ring_buf_put(&uart_ringbuf, &data, sizeof(uint8_t)) > 0) {
@@ -25,13 +41,23 @@ static void upgrade_callback_handler(uint8_t data)
     }
 }
 
+static uint32_t upgrade_rx_read(uint8_t *buf, uint32_t size)
+{
+    return ring_buf_get(&uart_ringbuf, buf, size);
+}
+#endif
+
 void upgrade_rx_thread(void *p1, void *p2, void *p3)
 {
     static bool timer_flag = false;
     uint16_t read_len = 0;
     uint8_t buf[UART_TEMP_BUF] = {0};
 
+#ifdef CONFIG_BL_UART_RAM_RESIDENT
+    bl_upgrade_notify_register(upgrade_notify_handler);
+#else
     bl_upgrade_callback_register(upgrade_callback_handler); //register callbacks
+#endif
     while (1)
     {
         k_sem_take(&rx_data_sem, K_FOREVER);
@@ -41,7 +67,9 @@ void upgrade_rx_thread(void *p1, void *p2, void *p3)
             timer_flag = true;
         }
 
-        while ((read_len = ring_buf_get(&uart_ringbuf, buf, sizeof(buf))) > 0) {
+        while ((read_len = upgrade_rx_read(buf, sizeof(buf))) > 0) {
+            // big frames only while the arena is in the transfer phase, a job may own it
+            bl_pkt_bind(mem_arena_hold() == MEM_PHASE_TRANSFER);
             for (uint16_t i = 0; i < read_len; i++) {
                 bool packet_finish = bl_received_handler(buf[i]);
                 if (packet_finish) {
@@ -49,7 +77,9 @@ void upgrade_rx_thread(void *p1, void *p2, void *p3)
                     k_sem_give(&pkt_sem);
                 }
             }
+            mem_arena_release();
         }
+        bl_upgrade_rx_overrun_report();
     }
 }
 
@@ -58,6 +88,8 @@ void packet_rx_thread(void *p1, void *p2, void *p3)
     while (1)
     {
         k_sem_take(&pkt_sem, K_FOREVER);
+        if (bl_frame_nak_flush())
+            continue;   // the parser dropped the frame itself
         bl_pkt_handler();
         bl_pkt_reset();
     }
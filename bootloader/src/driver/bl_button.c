@@ -59,6 +59,17 @@ void  bl_button_init(void)
     LOG_INF("button initialized successfully");
 }
 
+/* level of the key right now, the trap window may be 0 and miss the edge */
+bool bl_button_pressed(void)
+{
+    if (!gpio_is_ready_dt(&button))
+    {
+        return false;
+    }
+
+    return gpio_pin_get_dt(&button) > 0;
+}
+
 void disable_gpio_interrupts(void)
 {
     if (gpio_is_ready_dt(&button)) 
@@ -1,8 +1,10 @@
 #ifndef __BL_BUTTON_H
 #define __BL_BUTTON_H
 
+#include <stdbool.h>
 
 void bl_button_init(void);
+bool bl_button_pressed(void);
 void disable_gpio_interrupts(void);
 
 extern struct k_sem button_trap;
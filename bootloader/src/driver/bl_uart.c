@@ -5,6 +5,8 @@
 #include <zephyr/logging/log.h>
 #include <string.h>
 #include "bl_uart.h"
+#include "bl_trace.h"
+#include <soc.h>
 
 LOG_MODULE_REGISTER(uart, CONFIG_LOG_DEFAULT_LEVEL);
 
@@ -16,6 +18,126 @@ void bl_upgrade_callback_register(upgrade_rx_callback_t callback) {
     cb = callback;
 }
 
+#ifdef CONFIG_BL_UART_RAM_RESIDENT
+/*
+ * usart3 rx bypasses the zephyr driver isr: the vector in the SRAM vector
+ * table points straight at a RAM handler that drains DR into a RAM ring,
+ * so no flash fetch is needed while internal flash is erased or programmed.
+ * The receive thread is only woken when flash is idle, bytes received while
+ * it is busy are announced by bl_upgrade_rx_release().
+ */
+#define RX_RING_SIZE    CONFIG_BL_UART_RX_RING_SIZE
+#define RX_RING_MASK    (RX_RING_SIZE - 1)
+
+BUILD_ASSERT((RX_RING_SIZE & RX_RING_MASK) == 0, "rx ring size must be a power of two");
+
+static uint8_t rx_ring[RX_RING_SIZE] __ccm_noinit_section;
+static volatile uint32_t rx_head;
+static volatile uint32_t rx_tail;
+static volatile uint32_t rx_overrun;
+static volatile uint32_t rx_high_water;
+static uint32_t rx_overrun_total;
+static volatile bool rx_hold;
+static upgrade_rx_notify_t rx_notify;
+
+BL_RAMFUNC static void bl_upgrade_rx_isr(void)
+{
+    USART_TypeDef *usart = (USART_TypeDef *)DT_REG_ADDR(DT_NODELABEL(usart3));
+    bool received = false;
+
+    // reading DR after SR clears both RXNE and ORE
+    while (usart->SR & (USART_SR_RXNE | USART_SR_ORE)) {
+        uint8_t data = (uint8_t)usart->DR;
+        uint32_t head = rx_head;
+
+        if (head - rx_tail < RX_RING_SIZE) {
+            rx_ring[head & RX_RING_MASK] = data;
+            rx_head = head + 1;
+            received = true;
+            if (head + 1 - rx_tail > rx_high_water)
+                rx_high_water = head + 1 - rx_tail;
+        } else {
+            rx_overrun++;
+        }
+    }
+
+    if (received && !rx_hold && rx_notify != NULL) {
+        ISR_DIRECT_HEADER();
+        rx_notify();
+        ISR_DIRECT_FOOTER(1);
+    }
+}
+
+static void bl_upgrade_rx_isr_install(void)
+{
+    uint32_t *vectors = (uint32_t *)SCB->VTOR;
+
+    irq_disable(DT_IRQN(DT_NODELABEL(usart3)));
+    vectors[16 + DT_IRQN(DT_NODELABEL(usart3))] = (uint32_t)bl_upgrade_rx_isr;
+    __DSB();
+    __ISB();
+    irq_enable(DT_IRQN(DT_NODELABEL(usart3)));
+}
+
+void bl_upgrade_notify_register(upgrade_rx_notify_t notify)
+{
+    rx_notify = notify;
+}
+
+BL_RAMFUNC uint32_t bl_upgrade_rx_read(uint8_t *buf, uint32_t size)
+{
+    uint32_t tail = rx_tail;
+    uint32_t len = 0;
+
+    while (len < size && tail != rx_head) {
+        buf[len++] = rx_ring[tail & RX_RING_MASK];
+        tail++;
+    }
+    rx_tail = tail;
+    return len;
+}
+
+/* logging and trace live in flash, so overruns are only counted on the RAM path and reported here */
+void bl_upgrade_rx_overrun_report(void)
+{
+    unsigned int key = irq_lock();
+    uint32_t dropped = rx_overrun;
+    rx_overrun = 0;
+    irq_unlock(key);
+
+    if (dropped == 0)
+        return;
+    rx_overrun_total += dropped;
+    LOG_ERR("uart rx ring overrun, %u bytes dropped", dropped);
+    bl_trace(BL_TRACE_RX_OVERRUN, 0, dropped, 0);
+}
+
+void bl_upgrade_rx_stats_get(uint32_t *overruns, uint32_t *high_water)
+{
+    *overruns = rx_overrun_total + rx_overrun;
+    *high_water = rx_high_water;
+}
+
+void bl_upgrade_rx_stats_reset(void)
+{
+    rx_overrun_total = 0;
+    rx_high_water = 0;
+}
+
+void bl_upgrade_rx_hold(void)
+{
+    rx_hold = true;
+}
+
+void bl_upgrade_rx_release(void)
+{
+    rx_hold = false;
+    if (rx_head != rx_tail && rx_notify != NULL) {
+        rx_notify();
+    }
+}
+#endif
+
 void bl_upgrade_packet_send(uint8_t *data, uint32_t length)
 {
     if (!device_is_ready(uart_dev)) {
@@ -36,9 +158,26 @@ void bl_upgrade_packet_send(uint8_t *data, uint32_t length)
     LOG_DBG("response successfully %u bytes", length);
 }
 
+/*
+ * poll_out returns once the byte is in DR, the last one and the one in the
+ * shift register are still on the wire: wait for TC before the jump.
+ */
+void bl_upgrade_tx_drain(void)
+{
+    USART_TypeDef *usart = (USART_TypeDef *)DT_REG_ADDR(DT_NODELABEL(usart3));
+
+    if (!device_is_ready(uart_dev) || !(usart->CR1 & USART_CR1_UE))
+        return;
+
+    // two bytes take ~174 us at 115200, bounded in case the peripheral is stuck
+    for (int i = 0; i < 1000 && !(usart->SR & USART_SR_TC); i++)
+        k_busy_wait(1);
+}
+
+/* usart3 is deferred in devicetree, brought up only when the bootloader stays */
 void bl_upgrade_uart_init(void)
 {
-    if (!device_is_ready(uart_dev)) {
+    if (!device_is_ready(uart_dev) && device_init(uart_dev) != 0) {
         LOG_ERR("upgrade uart device not found!");
         return;
     }
@@ -52,7 +191,14 @@ void bl_upgrade_uart_init(void)
     };
     uart_configure(uart_dev, &uart_cfg);
 
+#ifdef CONFIG_BL_UART_RAM_RESIDENT
+    rx_head = 0;
+    rx_tail = 0;
+    bl_upgrade_rx_isr_install();
+    int ret = 0;
+#else
     int ret = uart_irq_callback_user_data_set(uart_dev, serial_irq_handler, NULL);
+#endif
 
     if (ret < 0) {
         if (ret == -ENOTSUP) {
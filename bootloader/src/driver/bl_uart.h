@@ -1,11 +1,37 @@
 #ifndef __BL_UART_H
 #define __BL_UART_H
 
+#ifdef CONFIG_BL_UART_RAM_RESIDENT
+#define BL_RAMFUNC      __ramfunc
+#define BL_RAMDATA      __ccm_bss_section
+#else
+#define BL_RAMFUNC
+#define BL_RAMDATA
+#endif
+
 typedef void (*upgrade_rx_callback_t) (uint8_t data);
+typedef void (*upgrade_rx_notify_t) (void);
 void bl_upgrade_uart_init(void);
 void bl_upgrade_uart_deinit(void);
 void bl_upgrade_callback_register(upgrade_rx_callback_t callback);
 void bl_upgrade_packet_send(uint8_t *data, uint32_t length);
+void bl_upgrade_tx_drain(void);
 void disable_uart_peripherals(void);
 
+#ifdef CONFIG_BL_UART_RAM_RESIDENT
+void bl_upgrade_notify_register(upgrade_rx_notify_t notify);
+uint32_t bl_upgrade_rx_read(uint8_t *buf, uint32_t size);
+void bl_upgrade_rx_overrun_report(void);
+void bl_upgrade_rx_hold(void);
+void bl_upgrade_rx_release(void);
+void bl_upgrade_rx_stats_get(uint32_t *overruns, uint32_t *high_water);
+void bl_upgrade_rx_stats_reset(void);
+#else
+static inline void bl_upgrade_rx_overrun_report(void) {}
+static inline void bl_upgrade_rx_hold(void) {}
+static inline void bl_upgrade_rx_release(void) {}
+static inline void bl_upgrade_rx_stats_get(uint32_t *overruns, uint32_t *high_water) { *overruns = 0; *high_water = 0; }
+static inline void bl_upgrade_rx_stats_reset(void) {}
+#endif
+
 #endif 
\ No newline at end of file
@@ -0,0 +1,401 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/crc.h>
+#include <string.h>
+#include "archive.h"
+#include "flash_area.h"
+#include "meta_desc.h"
+#include "nor_erase.h"
+#include "norflash.h"
+#include "hpatchlite.h"
+#include "partition.h"
+#include "mem_arena.h"
+#include "bl_job.h"
+
+LOG_MODULE_REGISTER(archive, CONFIG_LOG_DEFAULT_LEVEL);
+
+K_MUTEX_DEFINE(archive_action);
+
+#define ARCHIVE_BLOCK_SIZE          NOR_SECTOR_SIZE
+#define ARCHIVE_POOL_BLOCKS         (PARTITION_SIZE(archive_repo) / ARCHIVE_BLOCK_SIZE)
+
+/* meta_b: 0x0000 and 0x1000 slot roles | 0x2000 block crc index | 0x4000 manifests */
+#define ARCHIVE_INDEX_OFFSET        (2 * NOR_SECTOR_SIZE)
+#define ARCHIVE_INDEX_SIZE          (2 * NOR_SECTOR_SIZE)
+#define ARCHIVE_MANIFEST_OFFSET     (ARCHIVE_INDEX_OFFSET + ARCHIVE_INDEX_SIZE)
+#define ARCHIVE_MANIFEST_SIZE       256
+#define ARCHIVE_MANIFEST_COUNT      ((PARTITION_SIZE(meta_partition_b) - ARCHIVE_MANIFEST_OFFSET) / ARCHIVE_MANIFEST_SIZE)
+#define ARCHIVE_MANIFEST_BLOCKS     ((ARCHIVE_MANIFEST_SIZE - 24) / sizeof(uint16_t))
+#define ARCHIVE_MANIFEST_MAGIC      (0x41524348)
+
+#define ARCHIVE_INDEX_FREE          0xFFFFFFFF
+#define ARCHIVE_INDEX_CHUNK         64
+
+/* magic is programmed last, crc covers seq to the end of the block list */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t crc;
+    uint32_t seq;
+    uint32_t image_size;
+    uint32_t image_crc;
+    uint16_t block_count;
+    uint16_t reserved;
+    uint16_t blocks[ARCHIVE_MANIFEST_BLOCKS];
+} archive_manifest_t;
+
+BUILD_ASSERT(sizeof(archive_manifest_t) == ARCHIVE_MANIFEST_SIZE, "archive manifest size");
+BUILD_ASSERT(APP_FLASH_SIZE / ARCHIVE_BLOCK_SIZE <= ARCHIVE_MANIFEST_BLOCKS,
+             "application does not fit one archive manifest");
+BUILD_ASSERT(ARCHIVE_POOL_BLOCKS * sizeof(uint32_t) <= ARCHIVE_INDEX_SIZE,
+             "archive_repo too large for the block index");
+
+static archive_manifest_t manifest;
+BUILD_ASSERT(ARCHIVE_BLOCK_SIZE <= sizeof(((mem_copy_t *)0)->archive_block),
+             "archive block does not fit the arena copy region");
+static bool scanned;
+static uint32_t pool_next;          // first free pool block
+static uint32_t manifest_next;      // first free manifest slot
+static uint32_t manifest_seq;
+
+/* index entries hold the block crc, a crc equal to the free marker is stored one lower */
+static uint32_t index_key(const uint8_t *block)
+{
+    uint32_t crc = crc32_ieee(block, ARCHIVE_BLOCK_SIZE);
+    return crc == ARCHIVE_INDEX_FREE ? crc - 1 : crc;
+}
+
+static uint32_t manifest_crc(const archive_manifest_t *m)
+{
+    return crc32_ieee((const uint8_t *)&m->seq, sizeof(*m) - OFFSET_OF(archive_manifest_t, seq));
+}
+
+static bool manifest_read(const struct flash_area *fm, uint32_t slot, archive_manifest_t *m)
+{
+    if (flash_area_read(fm, ARCHIVE_MANIFEST_OFFSET + slot * sizeof(*m), m, sizeof(*m)) != 0)
+        return false;
+
+    return m->magic == ARCHIVE_MANIFEST_MAGIC && m->crc == manifest_crc(m) &&
+           m->block_count <= ARCHIVE_MANIFEST_BLOCKS;
+}
+
+static int archive_scan(const struct flash_area *fm)
+{
+    uint32_t keys[ARCHIVE_INDEX_CHUNK];
+
+    pool_next = 0;
+    for (uint32_t i = 0; i < ARCHIVE_POOL_BLOCKS; i += ARCHIVE_INDEX_CHUNK) {
+        uint32_t n = MIN(ARCHIVE_INDEX_CHUNK, ARCHIVE_POOL_BLOCKS - i);
+        if (flash_area_read(fm, ARCHIVE_INDEX_OFFSET + i * sizeof(uint32_t), keys, n * sizeof(uint32_t)) != 0)
+            return -EIO;
+        for (uint32_t j = 0; j < n && keys[j] != ARCHIVE_INDEX_FREE; j++)
+            pool_next = i + j + 1;
+        if (pool_next < i + n)
+            break;
+    }
+
+    manifest_next = 0;
+    manifest_seq = 0;
+    for (uint32_t slot = 0; slot < ARCHIVE_MANIFEST_COUNT; slot++) {
+        uint32_t head[2];
+        if (flash_area_read(fm, ARCHIVE_MANIFEST_OFFSET + slot * sizeof(manifest), head, sizeof(head)) != 0)
+            return -EIO;
+        // a slot torn before its magic still holds programmed bytes, it is skipped, not reused
+        if (head[0] == ARCHIVE_INDEX_FREE && head[1] == ARCHIVE_INDEX_FREE)
+            break;
+        manifest_next = slot + 1;
+        if (manifest_read(fm, slot, &manifest))
+            manifest_seq = MAX(manifest_seq, manifest.seq);
+    }
+
+    LOG_INF("archive: %u version slot used, %u / %u pool block", manifest_next, pool_next,
+            (uint32_t)ARCHIVE_POOL_BLOCKS);
+    scanned = true;
+    return 0;
+}
+
+/* newest manifest of the image, left in manifest */
+static bool archive_find(const struct flash_area *fm, uint32_t size, uint32_t crc)
+{
+    for (int slot = manifest_next - 1; slot >= 0; slot--) {
+        if (manifest_read(fm, slot, &manifest) && manifest.image_size == size && manifest.image_crc == crc)
+            return true;
+    }
+    return false;
+}
+
+/* pool and manifests start over, pool sectors are erased when they are reused */
+static int archive_reset(const struct flash_area *fm)
+{
+    LOG_WRN("archive full, start over");
+
+    int ret = nor_flash_area_erase(fm, ARCHIVE_INDEX_OFFSET, fm->fa_size - ARCHIVE_INDEX_OFFSET);
+    if (ret != 0)
+        return ret;
+
+    pool_next = 0;
+    manifest_next = 0;
+    return 0;
+}
+
+static bool pool_block_equal(const struct flash_area *fr, uint32_t id, const uint8_t *block)
+{
+    uint8_t chunk[256];
+
+    for (uint32_t off = 0; off < ARCHIVE_BLOCK_SIZE; off += sizeof(chunk)) {
+        if (flash_area_read(fr, id * ARCHIVE_BLOCK_SIZE + off, chunk, sizeof(chunk)) != 0)
+            return false;
+        if (memcmp(chunk, block + off, sizeof(chunk)) != 0)
+            return false;
+    }
+    return true;
+}
+
+/* crc index first, a hit is confirmed by comparing the bytes */
+static int pool_find(const struct flash_area *fm, const struct flash_area *fr, const uint8_t *block, uint32_t key)
+{
+    uint32_t keys[ARCHIVE_INDEX_CHUNK];
+
+    for (uint32_t i = 0; i < pool_next; i += ARCHIVE_INDEX_CHUNK) {
+        uint32_t n = MIN(ARCHIVE_INDEX_CHUNK, pool_next - i);
+        if (flash_area_read(fm, ARCHIVE_INDEX_OFFSET + i * sizeof(uint32_t), keys, n * sizeof(uint32_t)) != 0)
+            return -EIO;
+        for (uint32_t j = 0; j < n; j++) {
+            if (keys[j] == key && pool_block_equal(fr, i + j, block))
+                return i + j;
+        }
+    }
+    return -ENOENT;
+}
+
+static int pool_append(const struct flash_area *fm, const struct flash_area *fr, const uint8_t *block, uint32_t key)
+{
+    uint32_t id = pool_next;
+    int ret;
+
+    ret = nor_flash_area_erase(fr, id * ARCHIVE_BLOCK_SIZE, ARCHIVE_BLOCK_SIZE);
+    if (ret == 0)
+        ret = flash_area_write(fr, id * ARCHIVE_BLOCK_SIZE, block, ARCHIVE_BLOCK_SIZE);
+    // the index entry makes the block visible, a block torn before it is overwritten next time
+    if (ret == 0)
+        ret = flash_area_write(fm, ARCHIVE_INDEX_OFFSET + id * sizeof(uint32_t), &key, sizeof(key));
+    if (ret != 0) {
+        LOG_ERR("archive block %u program faild, ret %d", id, ret);
+        return ret;
+    }
+
+    pool_next++;
+    return id;
+}
+
+/* block i of the application image, the tail of the last block padded with 0xFF */
+static int image_block_read(const struct flash_area *fa, uint32_t size, uint32_t i, uint8_t *block)
+{
+    uint32_t off = i * ARCHIVE_BLOCK_SIZE;
+    uint32_t len = MIN(size - off, ARCHIVE_BLOCK_SIZE);
+
+    memset(block + len, 0xFF, ARCHIVE_BLOCK_SIZE - len);
+    return flash_area_read(fa, off, block, len);
+}
+
+int archive_store_image(uint32_t size, uint32_t crc)
+{
+    k_mutex_lock(&archive_action, K_FOREVER);
+    mem_arena_enter(MEM_PHASE_COPY);
+    uint8_t *block_buf = mem_arena_copy()->archive_block;
+
+    const struct flash_area *fm = partition_get(PART_META_B);
+    const struct flash_area *fr = partition_get(PART_ARCHIVE_REPO);
+    const struct flash_area *fa = partition_get(PART_APPLICATION);
+    uint32_t count = DIV_ROUND_UP(size, ARCHIVE_BLOCK_SIZE);
+    uint32_t fresh = 0;
+    int ret = 0;
+
+    if (fm == NULL || fr == NULL || fa == NULL) {
+        ret = -ENODEV;
+        goto cleanup;
+    }
+    if (size == 0 || count > ARCHIVE_MANIFEST_BLOCKS) {
+        ret = -EINVAL;
+        goto cleanup;
+    }
+    if (!scanned && (ret = archive_scan(fm)) != 0)
+        goto cleanup;
+
+    if (archive_find(fm, size, crc)) {
+        LOG_INF("archive: image crc 0x%08x already stored as seq %u", crc, manifest.seq);
+        goto cleanup;
+    }
+
+    // worst case every block is new
+    if (manifest_next >= ARCHIVE_MANIFEST_COUNT || pool_next + count > ARCHIVE_POOL_BLOCKS) {
+        ret = archive_reset(fm);
+        if (ret != 0)
+            goto cleanup;
+    }
+
+    memset(&manifest, 0xFF, sizeof(manifest));
+    manifest.seq = manifest_seq + 1;
+    manifest.image_size = size;
+    manifest.image_crc = crc;
+    manifest.block_count = count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        bl_job_progress(BL_JOB_PHASE_ARCHIVE, i, count);
+        if (image_block_read(fa, size, i, block_buf) != 0) {
+            ret = -EIO;
+            goto cleanup;
+        }
+
+        uint32_t key = index_key(block_buf);
+        int id = pool_find(fm, fr, block_buf, key);
+        if (id == -ENOENT) {
+            id = pool_append(fm, fr, block_buf, key);
+            fresh++;
+        }
+        if (id < 0) {
+            ret = id;
+            goto cleanup;
+        }
+        manifest.blocks[i] = id;
+    }
+
+    manifest.magic = ARCHIVE_MANIFEST_MAGIC;
+    manifest.crc = manifest_crc(&manifest);
+
+    off_t offset = ARCHIVE_MANIFEST_OFFSET + manifest_next * sizeof(manifest);
+    ret = flash_area_write(fm, offset + sizeof(uint32_t), (const uint8_t *)&manifest + sizeof(uint32_t),
+                           sizeof(manifest) - sizeof(uint32_t));
+    if (ret == 0)
+        ret = flash_area_write(fm, offset, &manifest.magic, sizeof(uint32_t));
+    if (ret != 0) {
+        LOG_ERR("archive manifest program faild, ret %d", ret);
+        goto cleanup;
+    }
+
+    manifest_next++;
+    manifest_seq = manifest.seq;
+    LOG_INF("archive: seq %u, size %u, crc 0x%08x, %u block, %u new, pool %u / %u", manifest.seq,
+            size, crc, count, fresh, pool_next, (uint32_t)ARCHIVE_POOL_BLOCKS);
+
+cleanup:
+    k_mutex_unlock(&archive_action);
+    return ret;
+}
+
+/*
+ * Brings an archived version back into the application partition. Only the
+ * internal sectors holding a block that differs are erased and programmed.
+ * The restored image is then promoted to active backup, so arg info, backup
+ * and application describe the same version.
+ */
+int archive_rollback(uint32_t size, uint32_t crc)
+{
+    k_mutex_lock(&archive_action, K_FOREVER);
+    mem_arena_enter(MEM_PHASE_COPY);
+    uint8_t *block_buf = mem_arena_copy()->archive_block;
+
+    const struct flash_area *fm = partition_get(PART_META_B);
+    const struct flash_area *fr = partition_get(PART_ARCHIVE_REPO);
+    const struct flash_area *fa = partition_get(PART_APPLICATION);
+    const struct device *dev;
+    struct flash_pages_info info;
+    uint32_t sectors = 0, restored = 0;
+    uint32_t ccrc = 0;
+    int ret = 0;
+
+    if (fm == NULL || fr == NULL || fa == NULL) {
+        ret = -ENODEV;
+        goto cleanup;
+    }
+    if (size > fa->fa_size) {
+        ret = -EINVAL;
+        goto cleanup;
+    }
+    if (!scanned && (ret = archive_scan(fm)) != 0)
+        goto cleanup;
+
+    if (!archive_find(fm, size, crc)) {
+        LOG_ERR("archive: no version with size %u, crc 0x%08x", size, crc);
+        ret = -ENOENT;
+        goto cleanup;
+    }
+
+    // the pool must still rebuild the image before internal flash is touched
+    for (uint32_t i = 0; i < manifest.block_count; i++) {
+        uint32_t len = MIN(size - i * ARCHIVE_BLOCK_SIZE, ARCHIVE_BLOCK_SIZE);
+        if (flash_area_read(fr, manifest.blocks[i] * ARCHIVE_BLOCK_SIZE, block_buf, len) != 0) {
+            ret = -EIO;
+            goto cleanup;
+        }
+        ccrc = crc32_ieee_update(ccrc, block_buf, len);
+    }
+    if (ccrc != crc) {
+        LOG_ERR("archive: seq %u rebuilds crc 0x%08x, expected 0x%08x", manifest.seq, ccrc, crc);
+        ret = -EBADMSG;
+        goto cleanup;
+    }
+
+    dev = flash_area_get_device(fa);
+    for (uint32_t off = 0; off < size; off += info.size) {
+        bl_job_progress(BL_JOB_PHASE_COPY, off, size);
+        ret = flash_get_page_info_by_offs(dev, fa->fa_off + off, &info);
+        if (ret != 0)
+            goto cleanup;
+        sectors++;
+
+        uint32_t end = MIN(size, off + info.size);
+        bool dirty = false;
+        for (uint32_t pos = off; pos < end && !dirty; pos += ARCHIVE_BLOCK_SIZE) {
+            uint32_t len = MIN(end - pos, ARCHIVE_BLOCK_SIZE);
+            ret = flash_area_read(fr, manifest.blocks[pos / ARCHIVE_BLOCK_SIZE] * ARCHIVE_BLOCK_SIZE, block_buf, len);
+            if (ret != 0) {
+                LOG_ERR("archive: block read at 0x%x faild, ret %d", pos, ret);
+                goto cleanup;
+            }
+            dirty = memcmp(block_buf, (const void *)(APP_BASE_ADDR + pos), len) != 0;
+        }
+        if (!dirty)
+            continue;
+
+        // a read faild after the erase leaves the sector blank, never programmed with a stale buffer
+        ret = bl_flash_area_erase(fa, off, info.size);
+        for (uint32_t pos = off; pos < end && ret == 0; pos += ARCHIVE_BLOCK_SIZE) {
+            uint32_t len = MIN(end - pos, ARCHIVE_BLOCK_SIZE);
+            ret = flash_area_read(fr, manifest.blocks[pos / ARCHIVE_BLOCK_SIZE] * ARCHIVE_BLOCK_SIZE, block_buf, len);
+            if (ret == 0)
+                ret = bl_flash_area_write(fa, pos, block_buf, len);
+        }
+        if (ret != 0) {
+            LOG_ERR("archive: restore sector at 0x%x faild, ret %d", off, ret);
+            goto cleanup;
+        }
+        restored++;
+    }
+
+    if (crc32_ieee((const uint8_t *)APP_BASE_ADDR, size) != crc) {
+        LOG_ERR("archive: rollback verify faild");
+        ret = -EFAULT;
+        goto cleanup;
+    }
+
+    // the active backup follows, recovery would otherwise bring the newer image back
+    ret = intflash_to_download_slot(size, crc);
+    if (ret != 0)
+        goto cleanup;
+    if (!bl_diff_info_copy(size, crc)) {
+        ret = -EIO;
+        goto cleanup;
+    }
+    ret = select_slot_to_active_backup_partition(FULL_PACKAGE_FLAG);
+    if (ret != 0)
+        goto cleanup;
+
+    LOG_INF("archive: rolled back to seq %u, %u / %u sector restored", manifest.seq, restored, sectors);
+
+cleanup:
+    k_mutex_unlock(&archive_action);
+    return ret;
+}
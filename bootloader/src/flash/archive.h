@@ -0,0 +1,14 @@
+#ifndef __ARCHIVE_H
+#define __ARCHIVE_H
+
+#include <stdint.h>
+
+/*
+ * Firmware archive on norflash2: every version is a manifest of 4KB block
+ * ids over a deduplicated block pool in archive_repo. Block crc index and
+ * manifests live in meta_b behind the slot role records.
+ */
+int archive_store_image(uint32_t size, uint32_t crc);
+int archive_rollback(uint32_t size, uint32_t crc);
+
+#endif
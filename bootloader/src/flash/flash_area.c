@@ -3,240 +3,423 @@
 #include <zephyr/drivers/flash.h>
 #include <zephyr/logging/log.h>
 #include "flash_area.h"
+#include "partition.h"
 #include "bitos.h"
+#include "bl_uart.h"
+#include "bl_stats.h"
+#include "bl_trace.h"
 
 LOG_MODULE_REGISTER(internal_flash, CONFIG_LOG_DEFAULT_LEVEL);
 
 K_MUTEX_DEFINE(flash_action);
 
-#if DT_NODE_EXISTS(DT_NODELABEL(flash0))
-    static const uint32_t flash_base = DT_REG_ADDR(DT_NODELABEL(flash0));
-#else
-    LOG_ERR("flash0 device not found in device tree");
-    flash_area_close(fa);
-    k_mutex_unlock(&flash_action);
-    return;
-#endif
-
-#define ARG_INFO_BYTE_NUMBER            16
 #define DEVICE_UPGRADE_VERIFY_MAGIC     0x1A2B3C4D
+#define DEVICE_VERIFIED_STAMP_MAGIC     0x5EA1ED01
+#define DEVICE_APP_MODIFIED_MAGIC       0x5EA1ED00
+#define DEVICE_UPGRADE_PENDING_MAGIC    0x5EA1ED02
 
-bool bl_flash_get_arginfo(uint32_t *fwaddr, uint32_t *fwsize, uint32_t *fwcrc)
+static int_erase_stats_t int_erase_stats;
+
+static bool bl_flash_region_is_blank(uint32_t address, uint32_t size)
 {
-    k_mutex_lock(&flash_action, K_FOREVER);
+    const volatile uint32_t *word = (const volatile uint32_t *)address;
 
-    const struct flash_area *farg;
-    uint32_t fw_magic;
+    for (uint32_t i = 0; i < size / sizeof(uint32_t); i++) {
+        if (word[i] != 0xFFFFFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    if (flash_area_open(FIXED_PARTITION_ID(arg_info), &farg) != 0) {
-        LOG_ERR("faild to open arg_info partition");
-        k_mutex_unlock(&flash_action);
-        return false;
+/*
+ * Erase every internal flash sector touched by [offset, offset + size),
+ * same as flash_area_erase(), but sectors that are already blank are skipped.
+ * STM32F4 sectors are 16K/64K/128K, a needless erase costs hundreds of ms.
+ */
+int bl_flash_area_erase(const struct flash_area *fa, uint32_t offset, uint32_t size)
+{
+    const struct device *dev = flash_area_get_device(fa);
+    struct flash_pages_info info;
+
+    if ((offset + size) > fa->fa_size || offset + size < offset) {
+        LOG_ERR("erase range out of partition, offset 0x%x size 0x%x", offset, size);
+        return -EINVAL;
     }
 
-    if (flash_area_read(farg, 0, &fw_magic, sizeof(uint32_t)) != 0) {
-        LOG_ERR("faild to read device arg info");
-        flash_area_close(farg);
-        k_mutex_unlock(&flash_action);
-        return false;
+    if (fa->fa_id == partition_table[PART_APPLICATION].fa_id) {
+        bl_app_modified_mark();
     }
 
-    if (fw_magic != DEVICE_UPGRADE_VERIFY_MAGIC) {
-        LOG_ERR("faild arg info magic mismatch 0x%08x != 0x%08x", fw_magic, 
-            DEVICE_UPGRADE_VERIFY_MAGIC);
-        flash_area_close(farg);
-        k_mutex_unlock(&flash_action);
-        return false;
+    uint32_t pos = fa->fa_off + offset;
+    uint32_t end = pos + size;
+
+    while (pos < end) {
+        int ret = flash_get_page_info_by_offs(dev, pos, &info);
+        if (ret != 0) {
+            LOG_ERR("get sector info faild at 0x%08x, ret %d", pos, ret);
+            return ret;
+        }
+
+        if (bl_flash_region_is_blank(INT_FLASH_BASE + info.start_offset, info.size)) {
+            int_erase_stats.blank_skips++;
+        } else {
+            uint32_t start = bl_stats_start();
+            bl_upgrade_rx_hold();
+            ret = flash_erase(dev, info.start_offset, info.size);
+            bl_upgrade_rx_release();
+            bl_stats_stop(BL_STAT_INT_ERASE, info.size, start);
+            bl_trace(BL_TRACE_INT_ERASE, 0, INT_FLASH_BASE + info.start_offset, info.size);
+            if (ret != 0) {
+                LOG_ERR("erase sector faild at 0x%08x, ret %d", (uint32_t)info.start_offset, ret);
+                return ret;
+            }
+            int_erase_stats.erase_ops++;
+        }
+        pos = info.start_offset + info.size;
     }
 
-    if (flash_area_read(farg, sizeof(uint32_t), fwaddr, sizeof(uint32_t)) != 0) {
-        LOG_ERR("faild to read firmware address info");
-        flash_area_close(farg);
-        k_mutex_unlock(&flash_action);
-        return false;
+    return 0;
+}
+
+/*
+ * flash_area_write() for internal flash, uart rx wakeups are held back
+ * while the write stalls the flash bus.
+ */
+int bl_flash_area_write(const struct flash_area *fa, uint32_t offset, const void *data, uint32_t size)
+{
+    uint32_t start = bl_stats_start();
+    bl_upgrade_rx_hold();
+    int ret = flash_area_write(fa, offset, data, size);
+    bl_upgrade_rx_release();
+    bl_stats_stop(BL_STAT_INT_PROGRAM, size, start);
+
+    return ret;
+}
+
+void bl_flash_erase_stats_get(int_erase_stats_t *stats)
+{
+    *stats = int_erase_stats;
+}
+
+/*
+ * arg_info is an append-only log of 16 byte records:
+ *   | magic | fwaddr | fwsize | fwcrc |
+ * the magic is programmed last and marks a record valid, the latest valid
+ * record wins. The 16K sector is only erased when no free slot is left,
+ * the install record and a set pending record are carried over.
+ *
+ * Two more records share the log:
+ *   | stamp magic | generation | sample crc | fwcrc |   image fully verified
+ *   | modified magic | generation | 0 | 0 |           application erased since
+ *   | pending magic | 1 or 0 | 0 | 0 |                  norflash journal holds an update
+ * generation is the slot of the install record, a stamp only counts while
+ * it is the newest record of the log.
+ */
+#define ARG_INFO_RECORD_COUNT           (ARG_FLASH_SIZE / ARG_INFO_BYTE_NUMBER)
+
+static const uint32_t *bl_arginfo_slot(int index)
+{
+    return (const uint32_t *)(ARG_BASE_ADDR + index * ARG_INFO_BYTE_NUMBER);
+}
+
+static bool bl_arginfo_slot_is_blank(int index)
+{
+    return bl_flash_region_is_blank((uint32_t)bl_arginfo_slot(index), ARG_INFO_BYTE_NUMBER);
+}
+
+/* first slot after the last one ever touched, ARG_INFO_RECORD_COUNT when full */
+static int bl_arginfo_next_slot(void)
+{
+    int index = ARG_INFO_RECORD_COUNT;
+
+    while (index > 0 && bl_arginfo_slot_is_blank(index - 1)) {
+        index--;
     }
+    return index;
+}
 
-    if (flash_area_read(farg, 2 * sizeof(uint32_t), fwsize, sizeof(uint32_t)) != 0) {
-        LOG_ERR("faild to read firmware size info");
-        flash_area_close(farg);
-        k_mutex_unlock(&flash_action);
-        return false;
+static int bl_arginfo_find(uint32_t magic)
+{
+    for (int index = bl_arginfo_next_slot() - 1; index >= 0; index--) {
+        if (bl_arginfo_slot(index)[0] == magic) {
+            return index;
+        }
     }
+    return -1;
+}
 
-    if (flash_area_read(farg, 3 * sizeof(uint32_t), fwcrc, sizeof(uint32_t)) != 0) {
-        LOG_ERR("faild to read firmware CRC info");
-        flash_area_close(farg);
-        k_mutex_unlock(&flash_action);
+/*
+ * Erases a full log and writes the carried records back to its start, a
+ * record of magic is about to be written and is not carried. Slot numbers
+ * change, so a generation is looked up only after this.
+ */
+static int bl_arginfo_make_room(uint32_t magic)
+{
+    const struct flash_area *farg = partition_get(PART_ARG_INFO);
+    int index = bl_arginfo_next_slot();
+    int ret = 0;
+
+    if (farg == NULL) {
+        return -ENODEV;
+    }
+
+    if (index >= ARG_INFO_RECORD_COUNT) {
+        static const uint32_t carried[] = { DEVICE_UPGRADE_VERIFY_MAGIC, DEVICE_UPGRADE_PENDING_MAGIC };
+        uint8_t keep[ARRAY_SIZE(carried)][ARG_INFO_BYTE_NUMBER];
+        int kept = 0;
+
+        for (int i = 0; i < ARRAY_SIZE(carried); i++) {
+            int found = bl_arginfo_find(carried[i]);
+            if (found < 0 || carried[i] == magic) {
+                continue;
+            }
+            if (carried[i] == DEVICE_UPGRADE_PENDING_MAGIC && bl_arginfo_slot(found)[1] == 0) {
+                continue;
+            }
+            memcpy(keep[kept++], bl_arginfo_slot(found), ARG_INFO_BYTE_NUMBER);
+        }
+
+        LOG_INF("arg info log full, erase sector");
+        ret = bl_flash_area_erase(farg, 0, farg->fa_size);
+        if (ret != 0) {
+            return ret;
+        }
+
+        for (index = 0; index < kept; index++) {
+            ret = bl_flash_area_write(farg, index * ARG_INFO_BYTE_NUMBER, keep[index], ARG_INFO_BYTE_NUMBER);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+    }
+    return ret;
+}
+
+static int bl_arginfo_write(const uint8_t *info)
+{
+    const struct flash_area *farg = partition_get(PART_ARG_INFO);
+    int ret = bl_arginfo_make_room(get_u32(info));
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    int index = bl_arginfo_next_slot();
+    off_t offset = index * ARG_INFO_BYTE_NUMBER;
+    ret = bl_flash_area_write(farg, offset + sizeof(uint32_t), info + sizeof(uint32_t),
+                              ARG_INFO_BYTE_NUMBER - sizeof(uint32_t));
+    if (ret == 0) {
+        ret = bl_flash_area_write(farg, offset, info, sizeof(uint32_t));
+    }
+
+    if (ret != 0) {
+        LOG_ERR("arg info record %d program faild, ret %d", index, ret);
+    }
+    return ret;
+}
+
+bool bl_flash_get_arginfo(uint32_t *fwaddr, uint32_t *fwsize, uint32_t *fwcrc)
+{
+    uint8_t info[ARG_INFO_BYTE_NUMBER];
+    uint8_t *pinfo = info + sizeof(uint32_t);
+
+    if (!bl_arginfo_read(info)) {
+        LOG_ERR("faild arg info record not found");
         return false;
     }
 
-    flash_area_close(farg);
-    k_mutex_unlock(&flash_action);
+    *fwaddr = get_u32_inc(&pinfo);
+    *fwsize = get_u32_inc(&pinfo);
+    *fwcrc = get_u32_inc(&pinfo);
 
     return true;
 }
 
-bool bl_diff_info_copy(uint32_t fwsize, uint32_t fwcrc)
+bool bl_arginfo_read(uint8_t *info)
 {
     k_mutex_lock(&flash_action, K_FOREVER);
 
-    const struct flash_area *farg, *fapp;
-    if (flash_area_open(FIXED_PARTITION_ID(arg_info), &farg) != 0) {
-        k_mutex_unlock(&flash_action);
-        return false;
+    int index = bl_arginfo_find(DEVICE_UPGRADE_VERIFY_MAGIC);
+    if (index >= 0) {
+        memcpy(info, bl_arginfo_slot(index), ARG_INFO_BYTE_NUMBER);
     }
 
-    if (flash_area_open(FIXED_PARTITION_ID(application), &fapp) != 0) {
-        k_mutex_unlock(&flash_action);
-        flash_area_close(farg);
-        return false;
-    }
+    k_mutex_unlock(&flash_action);
+    return index >= 0;
+}
 
-    if (flash_area_erase(farg, 0, farg->fa_size) != 0) {
-        k_mutex_unlock(&flash_action);
-        flash_area_close(farg);
-        flash_area_close(fapp);
+bool bl_arginfo_append(const uint8_t *info)
+{
+    if (get_u32(info) != DEVICE_UPGRADE_VERIFY_MAGIC) {
+        LOG_ERR("faild arg info magic mismatch 0x%08x != 0x%08x", get_u32(info),
+            DEVICE_UPGRADE_VERIFY_MAGIC);
         return false;
     }
 
-    uint8_t *info = (uint8_t *)k_malloc(sizeof(uint8_t) * ARG_INFO_BYTE_NUMBER);
+    k_mutex_lock(&flash_action, K_FOREVER);
+    int ret = bl_arginfo_write(info);
+    k_mutex_unlock(&flash_action);
+
+    return ret == 0;
+}
+
+static int bl_arginfo_record(uint32_t magic, uint32_t generation, uint32_t word2, uint32_t word3)
+{
+    uint8_t info[ARG_INFO_BYTE_NUMBER];
     uint8_t *pinfo = info;
-    put_u32_inc(&pinfo, DEVICE_UPGRADE_VERIFY_MAGIC);
-    put_u32_inc(&pinfo, flash_base + fapp->fa_off);
-    put_u32_inc(&pinfo, fwsize);
-    put_u32_inc(&pinfo, fwcrc);
 
-    if (flash_area_write(farg, 0, info, pinfo - info) != 0) {
-        k_mutex_unlock(&flash_action);
-        flash_area_close(farg);
-        flash_area_close(fapp);
-        k_free(info);
-        return false;
+    put_u32_inc(&pinfo, magic);
+    put_u32_inc(&pinfo, generation);
+    put_u32_inc(&pinfo, word2);
+    put_u32_inc(&pinfo, word3);
+
+    return bl_arginfo_write(info);
+}
+
+/* newest record is a stamp for the current install record of image fwcrc */
+bool bl_verified_stamp_get(uint32_t fwcrc, uint32_t *sample_crc)
+{
+    k_mutex_lock(&flash_action, K_FOREVER);
+
+    int last = bl_arginfo_next_slot() - 1;
+    int install = bl_arginfo_find(DEVICE_UPGRADE_VERIFY_MAGIC);
+    bool valid = false;
+
+    if (last >= 0 && install >= 0) {
+        const uint32_t *stamp = bl_arginfo_slot(last);
+        valid = stamp[0] == DEVICE_VERIFIED_STAMP_MAGIC && stamp[1] == (uint32_t)install &&
+                stamp[3] == fwcrc;
+        if (valid) {
+            *sample_crc = stamp[2];
+        }
     }
 
-    flash_area_close(farg);
-    flash_area_close(fapp);
     k_mutex_unlock(&flash_action);
-    return true;
+    return valid;
 }
 
-void get_device_flash_info(device_flash_info_t *device)
+int bl_verified_stamp_set(uint32_t fwcrc, uint32_t sample_crc)
 {
     k_mutex_lock(&flash_action, K_FOREVER);
 
-    const struct flash_area *fboot;
-    const struct flash_area *farg;
-    const struct flash_area *fapp;
+    // the stamp names the install slot, taken after a compaction may have moved it
+    int ret = bl_arginfo_make_room(DEVICE_VERIFIED_STAMP_MAGIC);
+    int install = bl_arginfo_find(DEVICE_UPGRADE_VERIFY_MAGIC);
 
-    if (flash_area_open(FIXED_PARTITION_ID(bootloader), &fboot) != 0) {
-        LOG_ERR("get boot info faild to open boot partition");
-        k_mutex_unlock(&flash_action);
-        return;
+    if (ret == 0 && install < 0) {
+        ret = -ENOENT;
+    } else if (ret == 0) {
+        ret = bl_arginfo_record(DEVICE_VERIFIED_STAMP_MAGIC, install, sample_crc, fwcrc);
     }
 
-    if (flash_area_open(FIXED_PARTITION_ID(arg_info), &farg) != 0) {
-        LOG_ERR("get arg info faild to open arg partition");
-        k_mutex_unlock(&flash_action);
-        return;
-    }
+    k_mutex_unlock(&flash_action);
+    return ret;
+}
 
-    if (flash_area_open(FIXED_PARTITION_ID(application), &fapp) != 0) {
-        LOG_ERR("get app info faild to open app partition");
-        k_mutex_unlock(&flash_action);
-        return;
+/* called before the application is erased, one record per stamp it revokes */
+void bl_app_modified_mark(void)
+{
+    k_mutex_lock(&flash_action, K_FOREVER);
+
+    // a compaction drops the stamp, nothing is left to revoke then
+    int last = bl_arginfo_make_room(DEVICE_APP_MODIFIED_MAGIC) == 0 ? bl_arginfo_next_slot() - 1 : -1;
+    if (last >= 0 && bl_arginfo_slot(last)[0] == DEVICE_VERIFIED_STAMP_MAGIC) {
+        bl_arginfo_record(DEVICE_APP_MODIFIED_MAGIC, bl_arginfo_slot(last)[1], 0, 0);
     }
 
-    device->boot_base_addr = flash_base + fboot->fa_off;
-    device->boot_flash_size = fboot->fa_size;  // 48K
-    device->arg_base_addr = flash_base + farg->fa_off;
-    device->arg_flash_size = farg->fa_size;  // 16K
-    device->app_base_addr = flash_base + fapp->fa_off;
-    device->app_flash_size = fapp->fa_size;  // 448K
+    k_mutex_unlock(&flash_action);
+}
 
+void bl_upgrade_pending_set(bool pending)
+{
+    k_mutex_lock(&flash_action, K_FOREVER);
+    bl_arginfo_record(DEVICE_UPGRADE_PENDING_MAGIC, pending, 0, 0);
     k_mutex_unlock(&flash_action);
 }
 
-void bl_flash_read(uint32_t address, uint8_t *buf, uint32_t size)
+/* checked before norflash is up, an interrupted update must reach ota_resume_task() */
+bool bl_upgrade_pending(void)
 {
     k_mutex_lock(&flash_action, K_FOREVER);
+    int index = bl_arginfo_find(DEVICE_UPGRADE_PENDING_MAGIC);
+    bool pending = index >= 0 && bl_arginfo_slot(index)[1] != 0;
+    k_mutex_unlock(&flash_action);
 
-    const struct flash_area *fapp;
-    
-    if (flash_area_open(FIXED_PARTITION_ID(application), &fapp) != 0) {
-        LOG_ERR("faild to open app partition");
-        k_mutex_unlock(&flash_action);
-        return;
-    }
+    return pending;
+}
+
+int bl_arginfo_prepare(void)
+{
+    k_mutex_lock(&flash_action, K_FOREVER);
 
-    const uint32_t block = 4096;
-    uint32_t offset = address - (flash_base + fapp->fa_off);
-    uint32_t chunk = size;
-    do
-    {
-        chunk = size > block ? block : size;
-        flash_area_read(fapp, offset, buf, size);
-        offset += chunk;
-        buf += chunk;
-        size -= chunk;
-    } while (size > 0);
+    const struct flash_area *farg = partition_get(PART_ARG_INFO);
+    int ret = 0;
+
+    if (farg == NULL) {
+        ret = -ENODEV;
+    } else if (bl_arginfo_next_slot() >= ARG_INFO_RECORD_COUNT) {
+        ret = bl_flash_area_erase(farg, 0, farg->fa_size);
+    }
 
     k_mutex_unlock(&flash_action);
+    return ret;
 }
 
-int bl_flash_erase(uint32_t address, uint32_t size)
+bool bl_diff_info_copy(uint32_t fwsize, uint32_t fwcrc)
 {
-    k_mutex_lock(&flash_action, K_FOREVER);
+    uint8_t info[ARG_INFO_BYTE_NUMBER];
+    uint8_t *pinfo = info;
 
-    const struct flash_area *fapp;
-    const struct flash_area *farg;
-    const struct flash_area *ft;
+    put_u32_inc(&pinfo, DEVICE_UPGRADE_VERIFY_MAGIC);
+    put_u32_inc(&pinfo, APP_BASE_ADDR);
+    put_u32_inc(&pinfo, fwsize);
+    put_u32_inc(&pinfo, fwcrc);
 
-    if (flash_area_open(FIXED_PARTITION_ID(application), &fapp) != 0) {
-        LOG_ERR("faild to open app partition");
-        k_mutex_unlock(&flash_action);
-        return -1;
-    }
+    return bl_arginfo_append(info);
+}
 
-    if (flash_area_open(FIXED_PARTITION_ID(arg_info), &farg) != 0) {
-        LOG_ERR("faild to open arg partition");
+void bl_flash_read(uint32_t address, uint8_t *buf, uint32_t size)
+{
+    k_mutex_lock(&flash_action, K_FOREVER);
+
+    const partition_desc_t *part = partition_lookup(address, size);
+    if (part == NULL) {
+        LOG_ERR("read range out of internal flash partitions");
         k_mutex_unlock(&flash_action);
-        flash_area_close(fapp);
-        return -1;
+        return;
     }
 
-    if (address >= flash_base + fapp->fa_off)
-        ft = fapp;
-    else
-        ft = farg;
+    flash_area_read(partition_get(part->id), address - part->base, buf, size);
 
-    uint32_t part_abs_start = flash_base + ft->fa_off;  // 0x08000000 + 0x10000 = 0x08010000
-    uint32_t part_abs_end = part_abs_start + ft->fa_size - 1;  // 0x0807FFFF
+    k_mutex_unlock(&flash_action);
+}
+
+int bl_flash_erase(uint32_t address, uint32_t size)
+{
+    k_mutex_lock(&flash_action, K_FOREVER);
 
-    if ((address < part_abs_start) || ((address + size - 1) > part_abs_end)) {
+    const partition_desc_t *part = partition_lookup(address, size);
+    if (part == NULL) {
         LOG_ERR("erase range out of app partition!");
         LOG_ERR("req range: 0x%08x - 0x%08x", address, address + size - 1);
-        flash_area_close(fapp);
-        flash_area_close(farg);
         k_mutex_unlock(&flash_action);
-        return -1;
+        return -EINVAL;
     }
 
-    uint32_t partition_offset = address - part_abs_start;  // 0x08010000 - 0x08010000 = 0
+    uint32_t partition_offset = address - part->base;  // 0x08010000 - 0x08010000 = 0
 
-    if (flash_area_erase(ft, partition_offset, size) != 0) {
-        LOG_ERR("erase faild flash offset 0x%08x, size 0x%08x", partition_offset, size);
-        flash_area_close(fapp);
-        flash_area_close(farg);
+    int ret = bl_flash_area_erase(partition_get(part->id), partition_offset, size);
+    if (ret != 0) {
+        LOG_ERR("erase faild flash offset 0x%08x, size 0x%08x, ret %d", partition_offset, size, ret);
         k_mutex_unlock(&flash_action);
-        return -1;
+        return ret < 0 ? ret : -EIO;
     }
 
     LOG_DBG("flash erase success!");
     LOG_INF("erase addr: 0x%08x - 0x%08x, partition offset: 0x%08x, size: %u bytes",
            address, address + size - 1, partition_offset, size);
 
-    flash_area_close(fapp);
-    flash_area_close(farg);
     k_mutex_unlock(&flash_action);
 
     return 0;
@@ -246,56 +429,27 @@ int bl_flash_program(uint32_t address, uint32_t size, uint8_t *data)
 {
     k_mutex_lock(&flash_action, K_FOREVER);
 
-    const struct flash_area *fapp;
-    const struct flash_area *farg;
-    const struct flash_area *ft;
-
-    if (flash_area_open(FIXED_PARTITION_ID(application), &fapp) != 0) {
-        LOG_ERR("faild to open app partition");
-        k_mutex_unlock(&flash_action);
-        return -1;
-    }
-
-    if (flash_area_open(FIXED_PARTITION_ID(arg_info), &farg) != 0) {
-        LOG_ERR("faild to open arg partition");
-        flash_area_close(fapp);
-        k_mutex_unlock(&flash_action);
-        return -1;
-    }
-
-    if (address >= flash_base + fapp->fa_off)
-        ft = fapp;
-    else
-        ft = farg;
-
-    uint32_t part_abs_start = flash_base + ft->fa_off;  // 0x08000000 + 0x10000 = 0x08010000
-    uint32_t part_abs_end = part_abs_start + ft->fa_size - 1;  // 0x0807FFFF
-
-    if ((address < part_abs_start) || ((address + size - 1) > part_abs_end)) {
+    const partition_desc_t *part = partition_lookup(address, size);
+    if (part == NULL) {
         LOG_ERR("program range out of app partition!");
         LOG_ERR("req range: 0x%08x - 0x%08x", address, address + size - 1);
-        flash_area_close(fapp);
-        flash_area_close(farg);
         k_mutex_unlock(&flash_action);
-        return -1;
+        return -EINVAL;
     }
 
-    uint32_t partition_offset = address - part_abs_start;  // 0x08010000 - 0x08010000 = 0
+    uint32_t partition_offset = address - part->base;  // 0x08010000 - 0x08010000 = 0
 
-    if (flash_area_write(ft, partition_offset, data, size) != 0) {
-        LOG_ERR("faild to program flash offset 0x%08x, size 0x%08x)", partition_offset, size);
-        flash_area_close(fapp);
-        flash_area_close(farg);
+    int ret = bl_flash_area_write(partition_get(part->id), partition_offset, data, size);
+    if (ret != 0) {
+        LOG_ERR("faild to program flash offset 0x%08x, size 0x%08x, ret %d", partition_offset, size, ret);
         k_mutex_unlock(&flash_action);
-        return -1;
+        return ret < 0 ? ret : -EIO;
     }
 
-    LOG_DBG("program flash success!");
-    LOG_INF("program addr: 0x%08x - 0x%08x, partition offset: 0x%08x, size: %u bytes",
+    bl_trace(BL_TRACE_INT_PROGRAM, 0, address, size);
+    LOG_DBG("program addr: 0x%08x - 0x%08x, partition offset: 0x%08x, size: %u bytes",
            address, address + size - 1, partition_offset, size);
 
-    flash_area_close(fapp);
-    flash_area_close(farg);
     k_mutex_unlock(&flash_action);
 
     return 0;
@@ -2,22 +2,33 @@
 #define __FLASH_AREA_H
 
 #include <stdint.h>
+#include <stdbool.h>
+
+struct flash_area;
+
+#define ARG_INFO_BYTE_NUMBER    16
 
 typedef struct
 {
-    uint32_t boot_base_addr;
-    uint32_t arg_base_addr;
-    uint32_t app_base_addr;
-    uint32_t boot_flash_size;
-    uint32_t arg_flash_size;
-    uint32_t app_flash_size;
-} device_flash_info_t;
+    uint32_t erase_ops;     // internal flash sectors erased
+    uint32_t blank_skips;   // sector erases avoided by blank check
+} int_erase_stats_t;
 
-void get_device_flash_info(device_flash_info_t *device);
 int bl_flash_erase(uint32_t address, uint32_t size);
+int bl_flash_area_erase(const struct flash_area *fa, uint32_t offset, uint32_t size);
+int bl_flash_area_write(const struct flash_area *fa, uint32_t offset, const void *data, uint32_t size);
+void bl_flash_erase_stats_get(int_erase_stats_t *stats);
 bool bl_diff_info_copy(uint32_t fwsize, uint32_t fwcrc);
 int bl_flash_program(uint32_t address, uint32_t size, uint8_t *data);
 void bl_flash_read(uint32_t address, uint8_t *buf, uint32_t size);
 bool bl_flash_get_arginfo(uint32_t *fwaddr, uint32_t *fwsize, uint32_t *fwcrc);
+bool bl_arginfo_read(uint8_t *info);
+bool bl_arginfo_append(const uint8_t *info);
+int bl_arginfo_prepare(void);
+bool bl_verified_stamp_get(uint32_t fwcrc, uint32_t *sample_crc);
+int bl_verified_stamp_set(uint32_t fwcrc, uint32_t sample_crc);
+void bl_app_modified_mark(void);
+void bl_upgrade_pending_set(bool pending);
+bool bl_upgrade_pending(void);
 
 #endif
\ No newline at end of file
@@ -14,6 +14,7 @@ void meta_desc_init(meta_desc_info_t *meta)
     meta->firmware_state = NONE;
     meta->Sequence_number = 0;
     meta->download_len = 0;
+    meta->package_len = 0;
     meta->target_crc = 0;
     meta->is_program = 0;
 
@@ -24,6 +24,7 @@ typedef struct
     uint32_t Sequence_number; // number
 
     uint32_t download_len;
+    uint32_t package_len; // length of the verified package, download_len is reset at verify
     uint32_t target_crc;
     uint32_t is_program;
 
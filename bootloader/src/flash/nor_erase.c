@@ -0,0 +1,160 @@
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <string.h>
+#include "nor_erase.h"
+#include "bl_stats.h"
+#include "bl_trace.h"
+#include "bl_job.h"
+
+LOG_MODULE_REGISTER(nor_erase, CONFIG_LOG_DEFAULT_LEVEL);
+
+/* W25Q128JV typical erase time (datasheet tSE / tBE2 / tCE), only used for the saved time estimate */
+#define NOR_SECTOR_ERASE_MS     45
+#define NOR_BLOCK_ERASE_MS      150
+#define NOR_CHIP_ERASE_MS       40000
+
+#define NOR_BLANK_CHECK_CHUNK   1024
+
+static nor_erase_stats_t erase_stats;
+static uint32_t blank_buf[NOR_BLANK_CHECK_CHUNK / sizeof(uint32_t)];
+
+/* reading back is ~100x cheaper than erasing, stop at the first programmed word */
+static bool nor_region_is_blank(const struct device *dev, uint32_t start, uint32_t size)
+{
+    while (size > 0) {
+        uint32_t chunk = size > NOR_BLANK_CHECK_CHUNK ? NOR_BLANK_CHECK_CHUNK : size;
+        if (flash_read(dev, start, blank_buf, chunk) != 0) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < chunk / sizeof(uint32_t); i++) {
+            if (blank_buf[i] != 0xFFFFFFFF) {
+                return false;
+            }
+        }
+        start += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+/*
+ * Split [offset, offset + size) of a NOR partition into the widest erase commands:
+ *   |4K head sectors|   aligned 64K blocks   |4K tail sectors|
+ * a range covering the whole device is erased with a single chip erase.
+ * Every flash_erase() call below is exactly one command wide, so the result
+ * does not depend on how the spi-nor driver splits larger requests.
+ * Sectors and blocks that already read back as 0xFF are not erased again.
+ */
+static int nor_area_erase(const struct flash_area *fa, uint32_t offset, uint32_t size, bool report)
+{
+    const struct device *dev = flash_area_get_device(fa);
+    uint64_t dev_size = 0;
+    uint32_t sector_ops = 0, block_ops = 0, chip_ops = 0, blank_skips = 0;
+    uint32_t erased = 0;
+    int ret = 0;
+
+    if (dev == NULL) {
+        return -ENODEV;
+    }
+
+    if (size == 0) {
+        return 0;
+    }
+
+    if ((offset + size) > fa->fa_size || offset + size < offset) {
+        LOG_ERR("erase range out of partition, offset 0x%x size 0x%x", offset, size);
+        return -EINVAL;
+    }
+
+    uint32_t start = fa->fa_off + offset;
+    uint32_t end = start + size;
+
+    if ((start | end) & (NOR_SECTOR_SIZE - 1)) {
+        LOG_ERR("erase range not sector aligned, 0x%08x - 0x%08x", start, end);
+        return -EINVAL;
+    }
+
+    uint32_t t0 = k_uptime_get_32();
+    uint32_t stat_start = bl_stats_start();
+
+    if (flash_get_size(dev, &dev_size) == 0 && start == 0 && size == dev_size) {
+        ret = flash_erase(dev, 0, size);
+        if (ret == 0) {
+            chip_ops++;
+            erased = size;
+        }
+    } else {
+        while (start < end) {
+            if (report)
+                bl_job_progress(BL_JOB_PHASE_ERASE, start - fa->fa_off - offset, size);
+            uint32_t step = NOR_SECTOR_SIZE;
+            if ((start & (NOR_BLOCK_SIZE - 1)) == 0 && (end - start) >= NOR_BLOCK_SIZE) {
+                step = NOR_BLOCK_SIZE;
+            }
+
+            if (nor_region_is_blank(dev, start, step)) {
+                blank_skips++;
+                start += step;
+                continue;
+            }
+
+            ret = flash_erase(dev, start, step);
+            if (ret != 0) {
+                LOG_ERR("erase faild at 0x%08x, ret %d", start, ret);
+                break;
+            }
+
+            if (step == NOR_BLOCK_SIZE) block_ops++;
+            else                        sector_ops++;
+            erased += step;
+            start += step;
+        }
+    }
+
+    uint32_t elapsed = k_uptime_get_32() - t0;
+    bl_stats_stop(BL_STAT_NOR_ERASE, size, stat_start);
+    bl_trace(BL_TRACE_NOR_ERASE, 0, fa->fa_off + offset, size);
+    uint32_t sector_only_ms = (size / NOR_SECTOR_SIZE) * NOR_SECTOR_ERASE_MS;
+    uint32_t planned_ms = sector_ops * NOR_SECTOR_ERASE_MS + block_ops * NOR_BLOCK_ERASE_MS +
+                          chip_ops * NOR_CHIP_ERASE_MS;
+    uint32_t saved_est = sector_only_ms > planned_ms ? sector_only_ms - planned_ms : 0;
+
+    erase_stats.sector_ops += sector_ops;
+    erase_stats.block_ops += block_ops;
+    erase_stats.chip_ops += chip_ops;
+    erase_stats.blank_skips += blank_skips;
+    erase_stats.erased_bytes += erased;
+    erase_stats.elapsed_ms += elapsed;
+    erase_stats.saved_est_ms += saved_est;
+
+    LOG_INF("erase plan %s 0x%x+0x%x: %u sector, %u block, %u chip, %u blank, %u bytes erased, %u ms (est. saved ~%u ms)",
+            dev->name, offset, size,
+            sector_ops, block_ops, chip_ops, blank_skips, erased, elapsed, saved_est);
+
+    return ret;
+}
+
+int nor_flash_area_erase(const struct flash_area *fa, uint32_t offset, uint32_t size)
+{
+    return nor_area_erase(fa, offset, size, false);
+}
+
+/* for the erase job only, journal and archive erases must not flip the job phase */
+int nor_flash_area_erase_progress(const struct flash_area *fa, uint32_t offset, uint32_t size)
+{
+    return nor_area_erase(fa, offset, size, true);
+}
+
+void nor_erase_stats_get(nor_erase_stats_t *stats)
+{
+    *stats = erase_stats;
+}
+
+void nor_erase_stats_reset(void)
+{
+    memset(&erase_stats, 0, sizeof(erase_stats));
+}
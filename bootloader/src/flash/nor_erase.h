@@ -0,0 +1,26 @@
+#ifndef __NOR_ERASE_H
+#define __NOR_ERASE_H
+
+#include <stdint.h>
+#include <zephyr/storage/flash_map.h>
+
+#define NOR_SECTOR_SIZE     (4 * 1024)
+#define NOR_BLOCK_SIZE      (64 * 1024)
+
+typedef struct
+{
+    uint32_t sector_ops;    // 4KB sector erase commands issued
+    uint32_t block_ops;     // 64KB block erase commands issued
+    uint32_t chip_ops;      // whole chip erase commands issued
+    uint32_t blank_skips;   // sector/block erases avoided by blank check
+    uint32_t erased_bytes;  // bytes erase commands succeeded on, blank skips excluded
+    uint32_t elapsed_ms;    // measured wall time spent in erase
+    uint32_t saved_est_ms;  // datasheet estimate of the time saved against sector-only erase, not measured
+} nor_erase_stats_t;
+
+int nor_flash_area_erase(const struct flash_area *fa, uint32_t offset, uint32_t size);
+int nor_flash_area_erase_progress(const struct flash_area *fa, uint32_t offset, uint32_t size);
+void nor_erase_stats_get(nor_erase_stats_t *stats);
+void nor_erase_stats_reset(void);
+
+#endif
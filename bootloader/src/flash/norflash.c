@@ -5,9 +5,17 @@
 #include <zephyr/storage/flash_map.h>
 #include <zephyr/sys/crc.h>
 #include <zephyr/sys/util.h>
+#include <string.h>
 #include "flash_area.h"
 #include "hpatchlite.h"
 #include "meta_desc.h"
+#include "nor_erase.h"
+#include "norflash.h"
+#include "partition.h"
+#include "bl_stats.h"
+#include "bl_trace.h"
+#include "mem_arena.h"
+#include "bl_job.h"
 
 LOG_MODULE_REGISTER(external_flash, CONFIG_LOG_DEFAULT_LEVEL);
 
@@ -16,19 +24,42 @@ LOG_MODULE_REGISTER(external_flash, CONFIG_LOG_DEFAULT_LEVEL);
 #error "Unsupported board: norflash1 or norflash2 devicetree alias is not defined"
 #endif
 
-#define META_PARTITION_A_ID     DT_FIXED_PARTITION_ID(DT_NODELABEL(meta_partition_a))
-#define ACTIVE_BACKUP_ID        DT_FIXED_PARTITION_ID(DT_NODELABEL(active_backup_partition))
-#define DOWNLOAD_SLOT_ID        DT_FIXED_PARTITION_ID(DT_NODELABEL(download_partition))
-#define DIFF_FW_SLOT_ID         DT_FIXED_PARTITION_ID(DT_NODELABEL(diff_fw_partition))
-#define FATFS_ID                DT_FIXED_PARTITION_ID(DT_NODELABEL(fatfs_partition))
-
-#define STM32_APPLICATION_FLASH_BASE    0x08010000
-
 K_MUTEX_DEFINE(norflash_action);
 
-#define PARTITION_ONE_SYMBOL_DEFINE     (0x11111111)
-#define PARTITION_TWO_SYMBOL_DEFINE     (0x22222222)
-#define PARTITION_INFO_OFFSET           (1024 * 64)
+/*
+ * slot role table, ping-pong between the first two sectors of meta_b,
+ * the valid record with the higher sequence number wins.
+ */
+#define SLOT_ROLE_MAGIC                 (0x524F4C45)
+#define SLOT_ROLE_RECORD_OFFSET(seq)    (((seq) & 1) * NOR_SECTOR_SIZE)
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint8_t slot[SLOT_ROLE_COUNT];  // physical slot of backup, download, diff
+    uint8_t reserved;
+    uint32_t backup_size;
+    uint32_t backup_crc;
+    uint32_t crc;
+} slot_role_record_t;
+
+static slot_role_record_t slot_role;
+
+/*
+ * update journal, append-only records behind the meta record in meta_a.
+ * Magic is programmed last, a record torn by power loss is never valid.
+ * Records ping-pong between two banks: a full bank is only left for the
+ * other one once that is erased, so the last record always survives.
+ */
+#define JOURNAL_MAGIC                   (0x4A524E4C)
+#define JOURNAL_OFFSET                  NOR_SECTOR_SIZE
+#define JOURNAL_BANK_SIZE(fm)           ROUND_DOWN(((fm)->fa_size - JOURNAL_OFFSET) / 2, NOR_SECTOR_SIZE)
+#define JOURNAL_BANK_OFFSET(fm, bank)   (JOURNAL_OFFSET + (bank) * JOURNAL_BANK_SIZE(fm))
+
+static int journal_bank;                // bank holding the last record
+static int journal_next = -1;           // next free record of that bank, -1 until scanned
+static journal_record_t journal_last;
 
 static const struct device *flashes[] = {
     DEVICE_DT_GET(DT_ALIAS(norflash1)),
@@ -44,6 +75,7 @@ static void flash_device_init(const struct device *flash)
 
     if (!device_is_ready(flash)) {
         LOG_ERR("%s not ready", flash->name);
+        k_mutex_unlock(&norflash_action);
         return;
     }
 
@@ -51,6 +83,7 @@ static void flash_device_init(const struct device *flash)
     rc = flash_get_size(flash, &size);
     if (rc < 0) {
         LOG_ERR("%s flash_get_size faild: %d", flash->name, rc);
+        k_mutex_unlock(&norflash_action);
         return;
     }
 
@@ -59,80 +92,239 @@ static void flash_device_init(const struct device *flash)
     k_mutex_unlock(&norflash_action);
 }
 
-uint32_t get_norflash_partition_pointer(void)
+static bool slot_role_record_valid(const slot_role_record_t *rec)
+{
+    if (rec->magic != SLOT_ROLE_MAGIC)
+        return false;
+
+    if (crc32_ieee((const uint8_t *)rec, OFFSET_OF(slot_role_record_t, crc)) != rec->crc)
+        return false;
+
+    uint32_t seen = 0;
+    for (int i = 0; i < SLOT_ROLE_COUNT; i++) {
+        if (rec->slot[i] >= SLOT_ROLE_COUNT || (seen & BIT(rec->slot[i])))
+            return false;
+        seen |= BIT(rec->slot[i]);
+    }
+    return true;
+}
+
+int nor_slot_roles_init(void)
 {
     k_mutex_lock(&norflash_action, K_FOREVER);
 
-    uint8_t buf[4];
-    int ret;
+    const struct flash_area *fm = partition_get(PART_META_B);
+    slot_role_record_t rec;
+    bool found = false;
 
-    ret = flash_read(flashes[1], 0, buf, sizeof(uint32_t));
-    if (ret != 0)
-    {
-        LOG_ERR("read norflash partition pointer info faild: %d", ret);
+    if (fm == NULL) {
         k_mutex_unlock(&norflash_action);
-        return 0;
+        return -ENODEV;
+    }
+
+    for (uint32_t i = 0; i < 2; i++) {
+        if (flash_area_read(fm, SLOT_ROLE_RECORD_OFFSET(i), &rec, sizeof(rec)) != 0)
+            continue;
+        if (!slot_role_record_valid(&rec))
+            continue;
+        if (!found || rec.seq > slot_role.seq) {
+            slot_role = rec;
+            found = true;
+        }
+    }
+
+    if (found && partition_slot_roles_set(slot_role.slot)) {
+        LOG_INF("slot roles seq %u: backup %u, download %u, diff %u", slot_role.seq,
+                slot_role.slot[0], slot_role.slot[1], slot_role.slot[2]);
+    } else {
+        memset(&slot_role, 0, sizeof(slot_role));
+        partition_slot_roles_get(slot_role.slot);
+        LOG_INF("slot role table not found, use default slots");
     }
 
     k_mutex_unlock(&norflash_action);
-    return *(uint32_t*)buf;
+    return 0;
 }
 
-void set_norflash_partition_pointer(uint32_t partition)
+/* image the last promotion put in the active backup, false before the first one */
+bool nor_active_backup_info(uint32_t *size, uint32_t *crc)
 {
     k_mutex_lock(&norflash_action, K_FOREVER);
-    
-    uint32_t *partitions = &partition;
+
+    *size = slot_role.backup_size;
+    *crc = slot_role.backup_crc;
+
+    k_mutex_unlock(&norflash_action);
+    return *size != 0;
+}
+
+static int slot_roles_commit(const uint8_t *slots, uint32_t backup_size, uint32_t backup_crc)
+{
+    const struct flash_area *fm = partition_get(PART_META_B);
+    slot_role_record_t rec = {0};
     int ret;
 
-    ret = flash_erase(flashes[0], 0, PARTITION_INFO_OFFSET);
-    if (ret != 0)
-    {
-        LOG_ERR("erase norflash partition pointer info faild: %d", ret);
-        k_mutex_unlock(&norflash_action);
-        return;
+    if (fm == NULL)
+        return -ENODEV;
+
+    rec.magic = SLOT_ROLE_MAGIC;
+    rec.seq = slot_role.seq + 1;
+    memcpy(rec.slot, slots, sizeof(rec.slot));
+    rec.backup_size = backup_size;
+    rec.backup_crc = backup_crc;
+    rec.crc = crc32_ieee((const uint8_t *)&rec, OFFSET_OF(slot_role_record_t, crc));
+
+    // the sector holding the current record is left alone until the new one is written
+    ret = nor_flash_area_erase(fm, SLOT_ROLE_RECORD_OFFSET(rec.seq), NOR_SECTOR_SIZE);
+    if (ret != 0) {
+        LOG_ERR("slot role sector erase faild, ret %d", ret);
+        return ret;
     }
 
-    ret = flash_write(flashes[0], 0, partitions, sizeof(uint32_t));
-    if (ret != 0)
-    {
-        LOG_ERR("program norflash partition pointer info faild: %d", ret);
-        k_mutex_unlock(&norflash_action);
-        return;
+    ret = flash_area_write(fm, SLOT_ROLE_RECORD_OFFSET(rec.seq), &rec, sizeof(rec));
+    if (ret != 0) {
+        LOG_ERR("slot role record program faild, ret %d", ret);
+        return ret;
     }
 
-    LOG_INF("set norflash partition pointer info success");
-    k_mutex_unlock(&norflash_action);
+    if (!partition_slot_roles_set(rec.slot))
+        return -EINVAL;
+
+    slot_role = rec;
+    return 0;
 }
 
-bool bl_verify_external_norflash_firmware(void)
+static bool journal_record_blank(const journal_record_t *rec)
+{
+    const uint32_t *w = (const uint32_t *)rec;
+
+    for (int i = 0; i < sizeof(*rec) / sizeof(uint32_t); i++) {
+        if (w[i] != 0xFFFFFFFF)
+            return false;
+    }
+    return true;
+}
+
+/* last valid record of both banks and the first blank slot behind it, cached until the next append */
+static int journal_scan(const struct flash_area *fm)
+{
+    uint32_t count = JOURNAL_BANK_SIZE(fm) / sizeof(journal_record_t);
+    uint32_t next[2] = { count, count };
+    journal_record_t rec;
+
+    memset(&journal_last, 0, sizeof(journal_last));
+    journal_bank = 0;
+    for (int bank = 0; bank < 2; bank++) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (flash_area_read(fm, JOURNAL_BANK_OFFSET(fm, bank) + i * sizeof(rec), &rec, sizeof(rec)) != 0)
+                return -EIO;
+            if (journal_record_blank(&rec)) {
+                next[bank] = i;
+                break;
+            }
+            if (rec.magic != JOURNAL_MAGIC ||
+                crc32_ieee((const uint8_t *)&rec, OFFSET_OF(journal_record_t, crc)) != rec.crc)
+                continue;
+            if (journal_last.magic != JOURNAL_MAGIC || (int32_t)(rec.seq - journal_last.seq) > 0) {
+                journal_last = rec;
+                journal_bank = bank;
+            }
+        }
+    }
+    journal_next = next[journal_bank];
+    return 0;
+}
+
+int nor_journal_append(journal_phase_t phase, uint32_t new_size, uint32_t new_crc, uint32_t progress)
 {
     k_mutex_lock(&norflash_action, K_FOREVER);
 
-    const struct flash_area *fbck = NULL;
-    uint32_t fwaddr = 0, fwsize = 0, fwcrc = 0;
-    bool check = true;
+    const struct flash_area *fm = partition_get(PART_META_A);
+    journal_record_t rec = {0};
+    int ret = 0;
 
-    const uint32_t block = 4096;
-    uint8_t *buf = (uint8_t *)k_malloc(sizeof(uint8_t) * block);
-    if (buf == NULL) {
-        check = false;
+    if (fm == NULL) {
+        ret = -ENODEV;
         goto cleanup;
     }
 
-    check = bl_flash_get_arginfo(&fwaddr, &fwsize, &fwcrc);
-    if (!check) {
+    if (journal_next < 0 && (ret = journal_scan(fm)) != 0)
         goto cleanup;
+
+    // arg_info tells the next boot to look at the journal, set before the first record of an update
+    bool active = journal_last.magic == JOURNAL_MAGIC && journal_last.phase != JOURNAL_IDLE;
+    if (!active && phase != JOURNAL_IDLE)
+        bl_upgrade_pending_set(true);
+
+    uint32_t count = JOURNAL_BANK_SIZE(fm) / sizeof(rec);
+    if (journal_next >= count) {
+        // the full bank keeps the last record until the first one of the other bank is in
+        int bank = !journal_bank;
+        ret = nor_flash_area_erase(fm, JOURNAL_BANK_OFFSET(fm, bank), JOURNAL_BANK_SIZE(fm));
+        if (ret != 0) {
+            LOG_ERR("journal bank %d erase faild, ret %d", bank, ret);
+            goto cleanup;
+        }
+        journal_bank = bank;
+        journal_next = 0;
     }
 
-    if (flash_area_open(ACTIVE_BACKUP_ID, &fbck)) {
-        check = false;
+    rec.magic = JOURNAL_MAGIC;
+    rec.seq = journal_last.seq + 1;
+    rec.phase = phase;
+    rec.new_size = new_size;
+    rec.new_crc = new_crc;
+    rec.progress = progress;
+    rec.crc = crc32_ieee((const uint8_t *)&rec, OFFSET_OF(journal_record_t, crc));
+
+    off_t offset = JOURNAL_BANK_OFFSET(fm, journal_bank) + journal_next * sizeof(rec);
+    ret = flash_area_write(fm, offset + sizeof(uint32_t), (const uint8_t *)&rec + sizeof(uint32_t),
+                           sizeof(rec) - sizeof(uint32_t));
+    if (ret == 0)
+        ret = flash_area_write(fm, offset, &rec.magic, sizeof(uint32_t));
+    if (ret != 0) {
+        LOG_ERR("journal record %d program faild, ret %d", journal_next, ret);
+        journal_next = -1;
         goto cleanup;
     }
 
+    journal_next++;
+    journal_last = rec;
+    bl_trace(BL_TRACE_JOURNAL, phase, progress, 0);
+    if (active && phase == JOURNAL_IDLE)
+        bl_upgrade_pending_set(false);
+
+cleanup:
+    k_mutex_unlock(&norflash_action);
+    return ret;
+}
+
+bool nor_journal_last(journal_record_t *rec)
+{
+    k_mutex_lock(&norflash_action, K_FOREVER);
+
+    const struct flash_area *fm = partition_get(PART_META_A);
+    bool found = false;
+
+    if (fm != NULL && (journal_next >= 0 || journal_scan(fm) == 0)) {
+        found = journal_last.magic == JOURNAL_MAGIC;
+        *rec = journal_last;
+    }
+
+    k_mutex_unlock(&norflash_action);
+    return found;
+}
+
+static bool active_backup_verify(const struct flash_area *fbck, uint8_t *buf, uint32_t block,
+                                 uint32_t fwsize, uint32_t fwcrc)
+{
     uint32_t size = fwsize;
     uint32_t offset = 0;
     uint32_t ccrc = 0;
+
+    if (fwsize == 0 || fwsize > fbck->fa_size)
+        return false;
+
     do {
         uint32_t chunk = size > block ? block : size;
         flash_area_read(fbck, offset, buf, chunk);
@@ -141,32 +333,74 @@ bool bl_verify_external_norflash_firmware(void)
         size -= chunk;
     } while (size > 0);
 
-    if (ccrc != fwcrc) {
-        LOG_ERR("backup partition verify faild");
+    return ccrc == fwcrc;
+}
+
+bool bl_active_backup_is_valid(void)
+{
+    k_mutex_lock(&norflash_action, K_FOREVER);
+
+    const struct flash_area *fbck = partition_get(PART_ACTIVE_BACKUP);
+    uint32_t fwaddr = 0, fwsize = 0, fwcrc = 0;
+    bool check = false;
+
+    const uint32_t block = MEM_PAGE_SIZE;
+    uint8_t *buf = mem_arena_page();
+    if (fbck == NULL) {
+        goto cleanup;
+    }
+
+    if (bl_flash_get_arginfo(&fwaddr, &fwsize, &fwcrc)) {
+        check = active_backup_verify(fbck, buf, block, fwsize, fwcrc);
+    }
+
+cleanup:
+    k_mutex_unlock(&norflash_action);
+    return check;
+}
+
+bool bl_verify_external_norflash_firmware(void)
+{
+    k_mutex_lock(&norflash_action, K_FOREVER);
+
+    const struct flash_area *fbck = partition_get(PART_ACTIVE_BACKUP);
+    const struct flash_area *fapp = partition_get(PART_APPLICATION);
+    uint32_t fwaddr = 0, fwsize = 0, fwcrc = 0;
+    bool check = true;
+
+    mem_arena_enter(MEM_PHASE_COPY);
+    const uint32_t block = MEM_PAGE_SIZE;
+    uint8_t *buf = mem_arena_page();
+    if (fbck == NULL || fapp == NULL) {
         check = false;
         goto cleanup;
     }
 
-    LOG_INF("select backup partition recover");
-    
-    const struct flash_area *fapp = NULL;
-    if (flash_area_open(FIXED_PARTITION_ID(application), &fapp)) {
+    check = bl_flash_get_arginfo(&fwaddr, &fwsize, &fwcrc);
+    if (!check) {
+        goto cleanup;
+    }
+
+    if (!active_backup_verify(fbck, buf, block, fwsize, fwcrc)) {
+        LOG_ERR("backup partition verify faild");
         check = false;
         goto cleanup;
     }
 
-    if (flash_area_erase(fapp, 0, fwsize)) {
+    LOG_INF("select backup partition recover");
+
+    if (bl_flash_area_erase(fapp, 0, fwsize)) {
         LOG_ERR("internal flash erase faild");
         check = false;
         goto cleanup;
     }
 
-    offset = 0;
-    size = fwsize;
+    uint32_t offset = 0;
+    uint32_t size = fwsize;
     do {
         uint32_t chunk = size > block ? block : size;
         flash_area_read(fbck, offset, buf, chunk);
-        flash_area_write(fapp, offset, buf, chunk);
+        bl_flash_area_write(fapp, offset, buf, chunk);
         offset += chunk;
         size -= chunk;
 
@@ -178,9 +412,6 @@ bool bl_verify_external_norflash_firmware(void)
     LOG_INF("recover success");
 
 cleanup:
-    if (buf) k_free(buf);
-    if (fbck) flash_area_close(fbck);
-    if (fapp) flash_area_close(fapp);
     k_mutex_unlock(&norflash_action);
     return check;
 }
@@ -189,15 +420,14 @@ int nor_flash_erase_download_slot(void)
 {
     k_mutex_lock(&norflash_action, K_FOREVER);
 
-    const struct flash_area *fa, *fm;
+    const struct flash_area *fa = partition_get(PART_DOWNLOAD);
+    const struct flash_area *fm = partition_get(PART_META_A);
     uint32_t ccrc = 0;
     int ret;
 
-    ret = flash_area_open(META_PARTITION_A_ID, &fm);
-    if (ret != 0) {
-        LOG_ERR("opening meta_a slot partition faild, ret %d", ret);
+    if (fa == NULL || fm == NULL) {
         k_mutex_unlock(&norflash_action);
-        return ret;
+        return -ENODEV;
     }
 
     uint32_t write_len;
@@ -205,15 +435,6 @@ int nor_flash_erase_download_slot(void)
     ret = flash_area_read(fm, write_off, (void *)&write_len, sizeof(uint32_t));
     if (ret != 0) {
         LOG_ERR("read meta download_slot info faild, ret %d", ret);
-        flash_area_close(fm);
-        k_mutex_unlock(&norflash_action);
-        return ret;
-    }
-
-    ret = flash_area_open(DOWNLOAD_SLOT_ID, &fa);
-    if (ret != 0) {
-        LOG_ERR("opening download_slot partition faild, ret = %d", ret);
-        flash_area_close(fm);
         k_mutex_unlock(&norflash_action);
         return ret;
     }
@@ -221,23 +442,13 @@ int nor_flash_erase_download_slot(void)
     if (write_len != 0) {
         if (write_len > fa->fa_size) {
             LOG_ERR("write len of range download_slot size");
-            flash_area_close(fm);
-            flash_area_close(fa);
             k_mutex_unlock(&norflash_action);
             return -1;
         }
-        uint8_t *user = (uint8_t*)k_malloc(sizeof(uint8_t) * 4096); 
-        if (!user) {
-            LOG_ERR("malloc faild");
-            flash_area_close(fm);
-            flash_area_close(fa);
-            k_mutex_unlock(&norflash_action);
-            return -ENOMEM;
-        }
-
+        uint8_t *user = mem_arena_page();
         uint32_t tp_len = write_len;
         uint32_t offset = 0;
-        const uint32_t block = 4096;
+        const uint32_t block = MEM_PAGE_SIZE;
         do
         {
             uint32_t size = tp_len > block ? block : tp_len;
@@ -246,8 +457,6 @@ int nor_flash_erase_download_slot(void)
             offset += size;
             tp_len -= size;
         } while (tp_len > 0);
-
-        k_free(user);
     }
 
     uint32_t erase_offset;
@@ -278,7 +487,7 @@ int nor_flash_erase_download_slot(void)
         LOG_INF("eraseing download slot: write len: %d, offset 0x%x, size %d", 
                  write_len, erase_offset, erase_len);
         
-        ret = flash_area_erase(fa, erase_offset, erase_len);
+        ret = nor_flash_area_erase_progress(fa, erase_offset, erase_len);
         
         if (ret != 0) {
             LOG_ERR("erase faild ret %d", ret);
@@ -290,8 +499,6 @@ int nor_flash_erase_download_slot(void)
         ret = 0; 
     }
 
-    flash_area_close(fa);
-    flash_area_close(fm);
     k_mutex_unlock(&norflash_action);
     return ret;
 }
@@ -300,26 +507,24 @@ int nor_flash_program_download_slot(uint32_t address, uint32_t size, uint8_t *sr
 {
     k_mutex_lock(&norflash_action, K_FOREVER);
 
-    const struct flash_area *fa;
+    const struct flash_area *fa = partition_get(PART_DOWNLOAD);
     int ret;
 
-    ret = flash_area_open(DOWNLOAD_SLOT_ID, &fa);
-    if (ret != 0) {
-        LOG_ERR("opening download_slot partition faild, ret = %d", ret);
+    if (fa == NULL) {
         k_mutex_unlock(&norflash_action);
-        return ret;
+        return -ENODEV;
     }
 
-    uint32_t offset = address - STM32_APPLICATION_FLASH_BASE;
-    LOG_INF("begin program download slot: offset 0x%08lx, size %zu byte", 
-             (long)fa->fa_off + offset, size);
+    uint32_t offset = address - APP_BASE_ADDR;
     
+    uint32_t start = bl_stats_start();
     ret = flash_area_write(fa, offset, src, size);
+    bl_stats_stop(BL_STAT_NOR_PROGRAM, size, start);
+    bl_trace(BL_TRACE_NOR_PROGRAM, 0, offset, size);
     if (ret != 0) {
         LOG_ERR("program faild, ret %d", ret);
     }
 
-    flash_area_close(fa);
     k_mutex_unlock(&norflash_action);
     return ret;
 }
@@ -328,14 +533,17 @@ int nor_flash_program_meta_slot(meta_desc_info_t *meta)
 {
     k_mutex_lock(&norflash_action, K_FOREVER);
 
-    const struct flash_area *fa;
+    const struct flash_area *fa = partition_get(PART_META_A);
     int ret;
 
-    ret = flash_area_open(META_PARTITION_A_ID, &fa);
-    if (ret != 0)
-        LOG_ERR("meta partition open faild, ret %d", ret);
+    if (fa == NULL) {
+        LOG_ERR("meta partition open faild");
+        k_mutex_unlock(&norflash_action);
+        return -ENODEV;
+    }
     
-    ret = flash_area_erase(fa, 0, fa->fa_size); // 擦
+    // only the meta sector, the journal behind it is kept
+    ret = nor_flash_area_erase(fa, 0, NOR_SECTOR_SIZE); // 擦
     if (ret != 0)
         LOG_ERR("meta partition erase faild, ret %d", ret);
 
@@ -343,7 +551,6 @@ int nor_flash_program_meta_slot(meta_desc_info_t *meta)
     if (ret != 0)
         LOG_ERR("meta partition program faild, ret %d", ret);
 
-    flash_area_close(fa);
     k_mutex_unlock(&norflash_action);
     return ret;
 }
@@ -352,28 +559,21 @@ uint32_t download_slot_verify(uint32_t address, uint32_t size)
 {
     k_mutex_lock(&norflash_action, K_FOREVER);
 
-    const struct flash_area *fa;
-    int ret;
+    const struct flash_area *fa = partition_get(PART_DOWNLOAD);
     
-    ret = flash_area_open(DOWNLOAD_SLOT_ID, &fa);
-    if (ret != 0) {
-        LOG_ERR("meta partition open faild %d", ret);
+    if (fa == NULL) {
+        LOG_ERR("download partition open faild");
         k_mutex_unlock(&norflash_action);
         return 1;
     }
 
-    const uint32_t block = 4096;
-    uint32_t offset = address - STM32_APPLICATION_FLASH_BASE;
+    const uint32_t block = MEM_PAGE_SIZE;
+    uint32_t offset = address - APP_BASE_ADDR;
     uint32_t fw_crc = 0;
-    uint8_t *user = (uint8_t *)k_malloc(block);
-    uint8_t *puser = user;
-    if (user == NULL) {
-        flash_area_close(fa);
-        k_mutex_unlock(&norflash_action);
-        return 1;
-    }
+    uint8_t *puser = mem_arena_page();
 
     uint32_t remaining = size;
+    uint32_t start = bl_stats_start();
     do
     {
         uint32_t chunk = ( remaining > block ) ? block : remaining;
@@ -382,9 +582,8 @@ uint32_t download_slot_verify(uint32_t address, uint32_t size)
         offset += chunk;
         remaining -= chunk;
     } while (remaining > 0);
+    bl_stats_stop(BL_STAT_CRC, size, start);
 
-    k_free(user);
-    flash_area_close(fa);
     k_mutex_unlock(&norflash_action);
     return fw_crc;
 }
@@ -393,164 +592,152 @@ int download_slot_to_intflash(void)
 {
     k_mutex_lock(&norflash_action, K_FOREVER);
 
-    const struct flash_area *fa, *fb;
-    int ret;
-    
-    ret = flash_area_open(META_PARTITION_A_ID, &fa);
-    if (ret != 0) {
-        LOG_ERR("meta partition open faild");
-        k_mutex_unlock(&norflash_action);   
-        return -1;
-    }
-    
-    ret = flash_area_open(DOWNLOAD_SLOT_ID, & fb);
-    if (ret != 0) {
-        flash_area_close(fa);
-        LOG_ERR("download partition open faild");
-        k_mutex_unlock(&norflash_action);
-        return -1;
-    }
+    const struct flash_area *fa = partition_get(PART_META_A);
+    const struct flash_area *fb = partition_get(PART_DOWNLOAD);
+    meta_desc_info_t meta;
 
-    uint8_t *desc = (uint8_t *)k_malloc(sizeof(uint8_t) * 1024);
-    if (desc == NULL) {
-        flash_area_close(fa);
-        flash_area_close(fb);
+    if (fa == NULL || fb == NULL) {
+        LOG_ERR("meta or download partition open faild");
         k_mutex_unlock(&norflash_action);
         return -1;
     }
 
-    flash_area_read(fa, 0, desc, 1024);
-    meta_desc_info_t *meta = (meta_desc_info_t*)desc;
+    flash_area_read(fa, 0, &meta, sizeof(meta));
 
-    const uint32_t block = 4096;
-    uint32_t fw_size = meta->firmware_size;
-    uint8_t *user = (uint8_t *)k_malloc(sizeof(uint8_t) * block);
-    uint8_t *puser = user;
-    if (user == NULL) {
-        k_free(user);
-        k_free(desc);
-        flash_area_close(fa);
-        flash_area_close(fb);
-        LOG_ERR("k malloc faild");
-        k_mutex_unlock(&norflash_action);
-        return -1;
-    }
+    mem_arena_enter(MEM_PHASE_COPY);
+    const uint32_t block = MEM_PAGE_SIZE;
+    uint32_t fw_size = meta.firmware_size;
+    uint8_t *puser = mem_arena_page();
 
-    LOG_INF("begin erase internal flash, addr %08x, size %d", meta->firmware_addr, meta->firmware_size);
-    bl_flash_erase(meta->firmware_addr, meta->firmware_size);
+    LOG_INF("begin erase internal flash, addr %08x, size %d", meta.firmware_addr, meta.firmware_size);
+    bl_flash_erase(meta.firmware_addr, meta.firmware_size);
 
     uint32_t offset = 0;
     do
     {
         uint32_t chunk = fw_size > block ? block : fw_size;
         flash_area_read(fb, offset, puser, chunk);
-        bl_flash_program(meta->firmware_addr + offset, chunk, puser);
+        bl_flash_program(meta.firmware_addr + offset, chunk, puser);
         offset += chunk;
+        bl_job_progress(BL_JOB_PHASE_COPY, offset, meta.firmware_size);
         fw_size -= chunk;
     } while (fw_size > 0);
 
-    k_free(user);
-    k_free(desc);
-    flash_area_close(fa);
-    flash_area_close(fb);
     k_mutex_unlock(&norflash_action);
     return 0;
 }
 
-int select_slot_to_active_backup_partition(int flag)
+/*
+ * The image in internal flash goes into the download slot, checked against
+ * crc. A promotion with FULL_PACKAGE_FLAG then makes it the active backup.
+ */
+int intflash_to_download_slot(uint32_t size, uint32_t crc)
 {
     k_mutex_lock(&norflash_action, K_FOREVER);
 
-    const struct flash_area *fa = NULL, *fb = NULL, *fc = NULL;
+    const struct flash_area *fa = partition_get(PART_DOWNLOAD);
     int ret = 0;
-    uint8_t *user = NULL;
-    uint32_t fw_size = 0;
-    uint8_t *desc = NULL;
 
-    ret = flash_area_open(META_PARTITION_A_ID, &fa);
-    if (ret != 0) {
-        LOG_ERR("meta partition open faild");
+    if (fa == NULL) {
+        ret = -ENODEV;
         goto cleanup;
     }
-    
-    if (flag == FULL_PACKAGE_FLAG) {
-        ret = flash_area_open(DOWNLOAD_SLOT_ID, &fb);
-        if (ret != 0) {
-            LOG_ERR("download partition open faild");
-            goto cleanup;
-        }
-    } else if (flag == DIFF_PACKAGE_FLAG) {
-        ret = flash_area_open(DIFF_FW_SLOT_ID, &fb);
-        if (ret != 0) {
-            LOG_ERR("download partition open faild");
-            goto cleanup;
-        }
+    if (size == 0 || size > fa->fa_size) {
+        ret = -EINVAL;
+        goto cleanup;
+    }
+
+    ret = nor_flash_area_erase(fa, 0, ROUND_UP(size, NOR_SECTOR_SIZE));
+    if (ret != 0)
+        goto cleanup;
+
+    for (uint32_t offset = 0; offset < size && ret == 0; offset += MEM_PAGE_SIZE) {
+        uint32_t chunk = MIN(size - offset, MEM_PAGE_SIZE);
+        bl_job_progress(BL_JOB_PHASE_BACKUP, offset, size);
+        ret = flash_area_write(fa, offset, (const void *)(APP_BASE_ADDR + offset), chunk);
     }
-    
-    ret = flash_area_open(ACTIVE_BACKUP_ID, &fc);
     if (ret != 0) {
-        LOG_ERR("active back partition open faild");
+        LOG_ERR("download slot program faild, ret %d", ret);
         goto cleanup;
     }
 
-    meta_desc_info_t *meta = NULL;
+    if (!active_backup_verify(fa, mem_arena_page(), MEM_PAGE_SIZE, size, crc)) {
+        LOG_ERR("download slot verify faild, crc 0x%08x", crc);
+        ret = -EBADMSG;
+    }
+
+cleanup:
+    k_mutex_unlock(&norflash_action);
+    return ret;
+}
+
+/*
+ * The new image already sits verified in the download or diff slot, promote
+ * it by swapping roles with the backup slot instead of copying it over.
+ */
+int select_slot_to_active_backup_partition(int flag)
+{
+    k_mutex_lock(&norflash_action, K_FOREVER);
+
+    partition_id_t role;
+    uint32_t fwaddr, fw_size, fwcrc;
+    uint8_t slots[SLOT_ROLE_COUNT];
+    int ret;
+
     if (flag == FULL_PACKAGE_FLAG) {
-        desc = (uint8_t *)k_malloc(sizeof(uint8_t) * 1024);
-        if (desc == NULL) {
-            LOG_ERR("k malloc faild");
-            goto cleanup;
-        }
-        flash_area_read(fa, 0, desc, 1024);
-        meta= (meta_desc_info_t*)desc;
-        fw_size = meta->firmware_size;
-    } else if(flag == DIFF_PACKAGE_FLAG) {
-        const struct flash_area *farg = NULL;
-        ret = flash_area_open(FIXED_PARTITION_ID(arg_info), &farg);
-        if (ret != 0)
-            goto cleanup;
-        ret = flash_area_read(farg, 2 * sizeof(uint32_t), &fw_size, sizeof(uint32_t));
-        if (ret != 0)
-            goto cleanup;
-        flash_area_close(farg);
+        role = PART_DOWNLOAD;
+    } else if (flag == DIFF_PACKAGE_FLAG) {
+        role = PART_DIFF_FW;
+    } else {
+        ret = -EINVAL;
+        goto cleanup;
     }
 
-    const uint32_t block = 4096;
-    user = (uint8_t *)k_malloc(sizeof(uint8_t) * block);
-    if (user == NULL) {
-        LOG_ERR("k malloc faild");
+    if (!bl_flash_get_arginfo(&fwaddr, &fw_size, &fwcrc)) {
+        ret = -EIO;
         goto cleanup;
     }
 
-    LOG_INF("begin erase active backup flash, size %zu", fc->fa_size);
-    flash_area_erase(fc, 0, fc->fa_size);
+    partition_slot_roles_get(slots);
+    uint8_t backup = slots[role - SLOT_ROLE_FIRST];
+    slots[role - SLOT_ROLE_FIRST] = slots[0];
+    slots[0] = backup;
 
-    uint32_t offset = 0;
-    do
-    {
-        uint32_t chunk = fw_size > block ? block : fw_size;
-        flash_area_read(fb, offset, user, chunk);
-        flash_area_write(fc, offset, user, chunk);
-        offset += chunk;
-        fw_size -= chunk;
-    } while (fw_size > 0);
+    ret = slot_roles_commit(slots, fw_size, fwcrc);
+    if (ret != 0) {
+        LOG_ERR("slot role commit faild, ret %d", ret);
+        goto cleanup;
+    }
 
-    LOG_INF("active backup success");
+    LOG_INF("active backup success, slot %u promoted, size %u, seq %u", backup, fw_size, slot_role.seq);
 
 cleanup:
-    if (user) k_free(user);
-    if (desc) k_free(desc);
-    if (fa)   flash_area_close(fa);
-    if (fb)   flash_area_close(fb);
-    if (fc)   flash_area_close(fc);
     k_mutex_unlock(&norflash_action);
     return ret;
 }
 
-void norflash_init(void)
+/*
+ * The spi-nor devices are deferred in devicetree, a boot straight into the
+ * application never touches them. Called by every path that needs norflash.
+ */
+int norflash_init(void)
 {
-    flash_device_init(flashes[0]);
-    
-    k_msleep(100);
-    
-    flash_device_init(flashes[1]);
+    static bool ready;
+
+    if (ready)
+        return 0;
+
+    for (int i = 0; i < ARRAY_SIZE(flashes); i++) {
+        if (!device_is_ready(flashes[i])) {
+            int rc = device_init(flashes[i]);
+            if (rc != 0) {
+                LOG_ERR("%s init faild: %d", flashes[i]->name, rc);
+                return rc;
+            }
+        }
+        flash_device_init(flashes[i]);
+    }
+
+    ready = true;
+    return 0;
 }
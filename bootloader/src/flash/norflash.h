@@ -1,13 +1,43 @@
 #ifndef __NORFLASH_H
 #define __NORFLASH_H
 
-void norflash_init(void);
+#include <stdint.h>
+#include <stdbool.h>
+#include "meta_desc.h"
+
+typedef enum
+{
+    JOURNAL_IDLE,       // no update in flight
+    JOURNAL_PATCH,      // progress: diff slot bytes written and flushed
+    JOURNAL_COPY,       // progress: internal flash bytes copied, sector aligned
+    JOURNAL_PROMOTE,    // image installed, slot roles about to be swapped, the diff slot is no longer read
+} journal_phase_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t phase;
+    uint32_t new_size;
+    uint32_t new_crc;
+    uint32_t progress;
+    uint32_t seq;               // increases by one per record, the highest valid one is the last
+    uint32_t reserved;
+    uint32_t crc;
+} journal_record_t;
+
+int norflash_init(void);
+int nor_slot_roles_init(void);
 bool bl_verify_external_norflash_firmware(void);
+bool bl_active_backup_is_valid(void);
+bool nor_active_backup_info(uint32_t *size, uint32_t *crc);
 int nor_flash_erase_download_slot(void);
 int nor_flash_program_download_slot(uint32_t address, uint32_t size, uint8_t *src);
 int nor_flash_program_meta_slot(meta_desc_info_t *meta);
 uint32_t download_slot_verify(uint32_t address, uint32_t size);
 int download_slot_to_intflash(void);
+int intflash_to_download_slot(uint32_t size, uint32_t crc);
 int select_slot_to_active_backup_partition(int flag);
+int nor_journal_append(journal_phase_t phase, uint32_t new_size, uint32_t new_crc, uint32_t progress);
+bool nor_journal_last(journal_record_t *rec);
 
 #endif  
\ No newline at end of file
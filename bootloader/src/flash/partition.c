@@ -0,0 +1,150 @@
+#include <zephyr/kernel.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/logging/log.h>
+#include <string.h>
+#include "partition.h"
+
+LOG_MODULE_REGISTER(partition, CONFIG_LOG_DEFAULT_LEVEL);
+
+#define NOR_CHIP_SIZE(alias)        (DT_PROP(DT_ALIAS(alias), size) / 8)
+
+/* internal flash layout: bootloader | arg_info | application */
+BUILD_ASSERT(PARTITION_END(bootloader) <= PARTITION_OFFSET(arg_info),
+             "bootloader overlaps arg_info");
+BUILD_ASSERT(PARTITION_END(arg_info) <= PARTITION_OFFSET(application),
+             "arg_info overlaps application");
+BUILD_ASSERT(PARTITION_END(application) <= INT_FLASH_SIZE,
+             "application out of internal flash");
+BUILD_ASSERT(ARG_FLASH_SIZE >= 16, "arg_info too small for one arg record");
+
+/* every norflash slot must be able to hold a full application image */
+BUILD_ASSERT(PARTITION_SIZE(active_backup_partition) >= APP_FLASH_SIZE,
+             "active_backup smaller than application");
+BUILD_ASSERT(PARTITION_SIZE(download_partition) >= APP_FLASH_SIZE,
+             "download_slot smaller than application");
+BUILD_ASSERT(PARTITION_SIZE(diff_fw_partition) >= APP_FLASH_SIZE,
+             "diff_firmware_slot smaller than application");
+BUILD_ASSERT(PARTITION_SIZE(factory_fw) >= APP_FLASH_SIZE,
+             "factory_fw smaller than application");
+
+BUILD_ASSERT(PARTITION_END(diff_fw_partition) <= NOR_CHIP_SIZE(norflash1),
+             "norflash1 partitions out of chip");
+BUILD_ASSERT(PARTITION_END(archive_repo) <= NOR_CHIP_SIZE(norflash2),
+             "norflash2 partitions out of chip");
+
+BUILD_ASSERT(PART_DOWNLOAD == SLOT_ROLE_FIRST + 1 && PART_DIFF_FW == SLOT_ROLE_FIRST + 2,
+             "slot roles must be contiguous");
+
+#define INT_PARTITION(part, label) \
+    [part] = { part, DT_FIXED_PARTITION_ID(DT_NODELABEL(label)), true, \
+               PARTITION_ABS_ADDR(label), PARTITION_SIZE(label) }
+
+#define NOR_PARTITION(part, label) \
+    [part] = { part, DT_FIXED_PARTITION_ID(DT_NODELABEL(label)), false, \
+               PARTITION_OFFSET(label), PARTITION_SIZE(label) }
+
+const partition_desc_t partition_table[PART_COUNT] = {
+    INT_PARTITION(PART_BOOTLOADER, bootloader),
+    INT_PARTITION(PART_ARG_INFO, arg_info),
+    INT_PARTITION(PART_APPLICATION, application),
+    NOR_PARTITION(PART_META_A, meta_partition_a),
+    NOR_PARTITION(PART_ACTIVE_BACKUP, active_backup_partition),
+    NOR_PARTITION(PART_DOWNLOAD, download_partition),
+    NOR_PARTITION(PART_DIFF_FW, diff_fw_partition),
+    NOR_PARTITION(PART_META_B, meta_partition_b),
+    NOR_PARTITION(PART_FACTORY_FW, factory_fw),
+    NOR_PARTITION(PART_ARCHIVE_1, archive_1),
+    NOR_PARTITION(PART_ARCHIVE_2, archive_2),
+    NOR_PARTITION(PART_ARCHIVE_3, archive_3),
+    NOR_PARTITION(PART_ARCHIVE_4, archive_4),
+    NOR_PARTITION(PART_ARCHIVE_5, archive_5),
+    NOR_PARTITION(PART_ARCHIVE_6, archive_6),
+    NOR_PARTITION(PART_ARCHIVE_7, archive_7),
+    NOR_PARTITION(PART_ARCHIVE_8, archive_8),
+    NOR_PARTITION(PART_ARCHIVE_9, archive_9),
+    NOR_PARTITION(PART_ARCHIVE_10, archive_10),
+    NOR_PARTITION(PART_ARCHIVE_REPO, archive_repo),
+};
+
+static const struct flash_area *handles[PART_COUNT];
+
+/* physical slot holding each role, both relative to SLOT_ROLE_FIRST */
+static uint8_t slot_roles[SLOT_ROLE_COUNT] = { 0, 1, 2 };
+
+static int partition_open(bool internal)
+{
+    int ret = 0;
+
+    for (int i = 0; i < PART_COUNT; i++) {
+        if (handles[i] != NULL || partition_table[i].internal != internal)
+            continue;
+
+        int rc = flash_area_open(partition_table[i].fa_id, &handles[i]);
+        if (rc != 0) {
+            LOG_ERR("open partition %d faild, ret %d", i, rc);
+            handles[i] = NULL;
+            ret = rc;
+        }
+    }
+
+    return ret;
+}
+
+int partition_init_internal(void)
+{
+    return partition_open(true);
+}
+
+/* norflash partitions, only after norflash_init() brought the chips up */
+int partition_init_external(void)
+{
+    return partition_open(false);
+}
+
+const struct flash_area *partition_get(partition_id_t id)
+{
+    if (id >= PART_COUNT)
+        return NULL;
+
+    if (id >= SLOT_ROLE_FIRST && id < SLOT_ROLE_FIRST + SLOT_ROLE_COUNT)
+        return handles[SLOT_ROLE_FIRST + slot_roles[id - SLOT_ROLE_FIRST]];
+
+    return handles[id];
+}
+
+void partition_slot_roles_get(uint8_t *slots)
+{
+    memcpy(slots, slot_roles, sizeof(slot_roles));
+}
+
+/* slots must be a permutation, every physical slot holds exactly one role */
+bool partition_slot_roles_set(const uint8_t *slots)
+{
+    uint32_t seen = 0;
+
+    for (int i = 0; i < SLOT_ROLE_COUNT; i++) {
+        if (slots[i] >= SLOT_ROLE_COUNT || (seen & BIT(slots[i])))
+            return false;
+        seen |= BIT(slots[i]);
+    }
+
+    memcpy(slot_roles, slots, sizeof(slot_roles));
+    return true;
+}
+
+/* host addressable internal flash: arg_info and application */
+const partition_desc_t *partition_lookup(uint32_t address, uint32_t size)
+{
+    static const partition_id_t writable[] = { PART_APPLICATION, PART_ARG_INFO };
+
+    for (int i = 0; i < ARRAY_SIZE(writable); i++) {
+        const partition_desc_t *part = &partition_table[writable[i]];
+        if (address >= part->base && size <= part->size &&
+            address - part->base <= part->size - size) {
+            return part;
+        }
+    }
+
+    return NULL;
+}
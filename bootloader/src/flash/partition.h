@@ -0,0 +1,74 @@
+#ifndef __PARTITION_H
+#define __PARTITION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/storage/flash_map.h>
+
+#define INT_FLASH_BASE              DT_REG_ADDR(DT_NODELABEL(flash0))
+#define INT_FLASH_SIZE              DT_REG_SIZE(DT_NODELABEL(flash0))
+
+#define PARTITION_OFFSET(label)     DT_REG_ADDR(DT_NODELABEL(label))
+#define PARTITION_SIZE(label)       DT_REG_SIZE(DT_NODELABEL(label))
+#define PARTITION_END(label)        (PARTITION_OFFSET(label) + PARTITION_SIZE(label))
+#define PARTITION_ABS_ADDR(label)   (INT_FLASH_BASE + PARTITION_OFFSET(label))
+
+#define BOOT_BASE_ADDR              PARTITION_ABS_ADDR(bootloader)
+#define BOOT_FLASH_SIZE             PARTITION_SIZE(bootloader)
+#define ARG_BASE_ADDR               PARTITION_ABS_ADDR(arg_info)
+#define ARG_FLASH_SIZE              PARTITION_SIZE(arg_info)
+#define APP_BASE_ADDR               PARTITION_ABS_ADDR(application)
+#define APP_FLASH_SIZE              PARTITION_SIZE(application)
+
+typedef enum
+{
+    PART_BOOTLOADER,
+    PART_ARG_INFO,
+    PART_APPLICATION,
+    PART_META_A,
+    PART_ACTIVE_BACKUP,
+    PART_DOWNLOAD,
+    PART_DIFF_FW,
+    PART_META_B,
+    PART_FACTORY_FW,
+    PART_ARCHIVE_1,
+    PART_ARCHIVE_2,
+    PART_ARCHIVE_3,
+    PART_ARCHIVE_4,
+    PART_ARCHIVE_5,
+    PART_ARCHIVE_6,
+    PART_ARCHIVE_7,
+    PART_ARCHIVE_8,
+    PART_ARCHIVE_9,
+    PART_ARCHIVE_10,
+    PART_ARCHIVE_REPO,
+    PART_COUNT
+} partition_id_t;
+
+/*
+ * backup, download and diff are roles rotated over the three firmware
+ * slots of norflash1, partition_get() resolves them to the physical slot.
+ */
+#define SLOT_ROLE_FIRST             PART_ACTIVE_BACKUP
+#define SLOT_ROLE_COUNT             3
+
+typedef struct
+{
+    partition_id_t id;
+    uint8_t fa_id;
+    bool internal;
+    uint32_t base;      // absolute address for internal flash, device offset for norflash
+    uint32_t size;
+} partition_desc_t;
+
+extern const partition_desc_t partition_table[PART_COUNT];
+
+int partition_init_internal(void);
+int partition_init_external(void);
+const struct flash_area *partition_get(partition_id_t id);
+const partition_desc_t *partition_lookup(uint32_t address, uint32_t size);
+void partition_slot_roles_get(uint8_t *slots);
+bool partition_slot_roles_set(const uint8_t *slots);
+
+#endif
@@ -9,6 +9,9 @@
 #if (_IS_RUN_MEM_SAFE_CHECK)
 #   define __RUN_MEM_SAFE_CHECK
 #endif
+#if tuz_isNeedFastDecode
+#   include <string.h> //memcpy memmove
+#endif
 
 //low to high bitmap: xx?xx?xx?xx? ...
 #define _def_unpack_len(self,readBit,_read_lowbits){ \
@@ -145,6 +148,9 @@ tuz_TResult tuz_TStream_open(tuz_TStream* self,tuz_TInputStreamHandle inputStrea
     self->_dict.dict_cur=0;
     self->_dict.dict_size=dict_size;
     self->_dict.dict_buf=dict_and_cache;
+  #if tuz_isNeedFastDecode
+    self->_dict.dict_mask=((dict_size&(dict_size-1))==0)?(dict_size-1):0;
+  #endif
     
     self->_state.dictType_pos=0;
     self->_state.dict_pos_back=1;
@@ -176,6 +182,63 @@ static tuz_try_inline void _dict_write_byte(tuz_TStream* self,tuz_byte bdata){
     self->_dict.dict_cur=(index_pos<self->_dict.dict_size)?index_pos:0;
 }
 
+#if tuz_isNeedFastDecode
+static tuz_force_inline tuz_size_t _dict_wrap(const tuz_TStream* self,tuz_size_t pos){
+    //pos < 2*dict_size
+    if (self->_dict.dict_mask)
+        return pos&self->_dict.dict_mask;
+    return (pos<self->_dict.dict_size)?pos:pos-self->_dict.dict_size;
+}
+
+//copy len match bytes in runs, a run never wraps the dict and never reads
+//  bytes written by itself, so it is the same as the byte by byte copy
+static tuz_byte* _dict_copy_match(tuz_TStream* self,tuz_byte* out,tuz_size_t len){
+    tuz_byte* const dict=self->_dict.dict_buf;
+    const tuz_size_t dict_size=self->_dict.dict_size;
+    const tuz_size_t dist=dict_size-self->_state.dictType_pos; //back distance of the match
+    while (len){
+        const tuz_size_t dst=self->_dict.dict_cur;
+        const tuz_size_t src=_dict_wrap(self,dst+self->_state.dictType_pos);
+        tuz_size_t run=len;
+        if (run>dict_size-dst) run=dict_size-dst;
+        if (run>dict_size-src) run=dict_size-src;
+        if (run>dist) run=dist;
+        memmove(dict+dst,dict+src,run);
+        memcpy(out,dict+dst,run);
+        self->_dict.dict_cur=_dict_wrap(self,dst+run);
+        out+=run;
+        len-=run;
+    }
+    return out;
+}
+
+#if tuz_isNeedLiteralLine
+static tuz_byte* _cache_copy_literal(tuz_TStream* self,tuz_byte* out,tuz_size_t len){
+    _TInputCache* cache=&self->_code_cache;
+    while (len){
+        tuz_size_t run=cache->cache_end-cache->cache_begin;
+        const tuz_size_t room=self->_dict.dict_size-self->_dict.dict_cur;
+        if (run==0){ //refill by the byte path, same error handling as before
+            const tuz_byte bdata=_cache_read_1byte(cache);
+            _dict_write_byte(self,bdata);
+            *out++=bdata;
+            len--;
+            continue;
+        }
+        if (run>len) run=len;
+        if (run>room) run=room;
+        memcpy(out,cache->cache_buf+cache->cache_begin,run);
+        memcpy(self->_dict.dict_buf+self->_dict.dict_cur,out,run);
+        cache->cache_begin+=run;
+        self->_dict.dict_cur=(run<room)?(self->_dict.dict_cur+run):0;
+        out+=run;
+        len-=run;
+    }
+    return out;
+}
+#endif
+#endif //tuz_isNeedFastDecode
+
 tuz_TResult tuz_TStream_decompress_partial(tuz_TStream* self,tuz_byte* cur_out_data,tuz_size_t* data_size){
     tuz_byte* const out_data_end=cur_out_data+(*data_size);
 #ifdef __RUN_MEM_SAFE_CHECK
@@ -185,6 +248,17 @@ tuz_TResult tuz_TStream_decompress_partial(tuz_TStream* self,tuz_byte* cur_out_d
       copyDict_cmp_process:
         if (self->_state.dictType_len){ //copy from dict or out_data
           //copyDict_process:
+          #if tuz_isNeedFastDecode
+            if (cur_out_data<out_data_end){
+                tuz_size_t len=(tuz_size_t)(out_data_end-cur_out_data);
+                if (len>self->_state.dictType_len) len=(tuz_size_t)self->_state.dictType_len;
+                cur_out_data=_dict_copy_match(self,cur_out_data,len);
+                self->_state.dictType_len-=len;
+                goto copyDict_cmp_process;
+            }else{
+                break;
+            }
+          #else
             if (cur_out_data<out_data_end){
                 const tuz_byte bdata=_dict_read_byte(self);
                 _dict_write_byte(self,bdata);
@@ -194,12 +268,24 @@ tuz_TResult tuz_TStream_decompress_partial(tuz_TStream* self,tuz_byte* cur_out_d
             }else{
                 break;
             }
+          #endif
         }
 
   #if tuz_isNeedLiteralLine
       copyLiteral_cmp_process:
         if (self->_state.literalType_len){
           //copyLiteral_process:
+          #if tuz_isNeedFastDecode
+            if (cur_out_data<out_data_end){
+                tuz_size_t len=(tuz_size_t)(out_data_end-cur_out_data);
+                if (len>self->_state.literalType_len) len=(tuz_size_t)self->_state.literalType_len;
+                cur_out_data=_cache_copy_literal(self,cur_out_data,len);
+                self->_state.literalType_len-=len;
+                goto copyLiteral_cmp_process;
+            }else{
+                break;
+            }
+          #else
             if (cur_out_data<out_data_end){
                 const tuz_byte bdata=_cache_read_1byte(&self->_code_cache);
                 _dict_write_byte(self,bdata);
@@ -209,6 +295,7 @@ tuz_TResult tuz_TStream_decompress_partial(tuz_TStream* self,tuz_byte* cur_out_d
             }else{
                 break;
             }
+          #endif
         }
   #endif
   
@@ -15,6 +15,11 @@
 #   define tuz_isNeedLiteralLine 1
 #endif
 
+#ifndef tuz_isNeedFastDecode  // bulk copy of dict matchs & literal lines in tuz_TStream_decompress_partial
+//output is byte-exact with tuz_isNeedFastDecode==0, costs some code size
+#   define tuz_isNeedFastDecode 0
+#endif
+
 #if (_IS_USED_SHARE_hpatch_lite_types)
 #   include "hpatch_lite_types.h"  //in "HDiffPatch/libHDiffPatch/HPatchLite/"
 #   include "hpatch_lite_input_cache.h"
@@ -150,6 +155,9 @@ typedef struct _tuz_TDict{
     tuz_size_t      dict_cur;
     tuz_size_t      dict_size;
     tuz_byte*       dict_buf;
+  #if tuz_isNeedFastDecode
+    tuz_size_t      dict_mask; //dict_size-1 if dict_size is power of 2, else 0
+  #endif
 } _tuz_TDict;
 typedef struct _tuz_TState{
     tuz_size_t      dictType_pos;
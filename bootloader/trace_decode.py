@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+
+import sys
+import struct
+import argparse
+
+OPCODE_TRACE_READ = 0x13
+
+# keep in step with bl_trace_event_t in src/app/bl_trace.h
+EVENTS = {
+    1:  ("PKT_DISPATCH",    "opcode 0x{a0:02x} len {a1}"),
+    2:  ("PKT_RESPONSE",    "opcode 0x{a0:02x} err {a1} len {a2}"),
+    3:  ("FRAME_CRC_ERR",   "opcode 0x{a0:02x} got 0x{a1:04x} expected 0x{a2:04x}"),
+    4:  ("INT_PROGRAM",     "addr 0x{a1:08x} size {a2}"),
+    5:  ("INT_ERASE",       "addr 0x{a1:08x} size {a2}"),
+    6:  ("NOR_PROGRAM",     "offset 0x{a1:08x} size {a2}"),
+    7:  ("NOR_ERASE",       "offset 0x{a1:08x} size {a2}"),
+    8:  ("RX_OVERRUN",      "dropped {a1}"),
+    9:  ("PATCH_BEGIN",     "compress {a0} new size {a1}"),
+    10: ("PATCH_END",       "ret {a0s} new size {a1}"),
+    11: ("COPY_CHECKPOINT", "copied {a1} / {a2}"),
+    12: ("JOURNAL",         "phase {a0} progress {a1}"),
+}
+
+DUMP_HEADER = struct.Struct("<IIIHH")
+RECORD = struct.Struct("<IHHII")
+
+
+def crc16_xmodem(data):
+    crc = 0
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def parse_dump(data):
+    first_seq, next_seq, hz, count, size = DUMP_HEADER.unpack_from(data)
+    records = []
+    for i in range(count):
+        off = DUMP_HEADER.size + i * size
+        records.append((first_seq + i,) + RECORD.unpack_from(data, off))
+    return next_seq, hz, records
+
+
+def read_serial(port, baud):
+    import serial
+
+    ser = serial.Serial(port, baud, timeout=1)
+    seq, hz, records = 0, 0, []
+    while True:
+        frame = struct.pack("<BBHI", 0xAA, OPCODE_TRACE_READ, 4, seq)
+        ser.write(frame + struct.pack("<H", crc16_xmodem(frame)))
+
+        head = ser.read(5)
+        if len(head) != 5:
+            raise RuntimeError("no response")
+        _, opcode, err, length = struct.unpack("<BBBH", head)
+        body = ser.read(length + 2)
+        if crc16_xmodem(head + body[:length]) != struct.unpack_from("<H", body, length)[0]:
+            raise RuntimeError("response crc mismatch")
+        if opcode != OPCODE_TRACE_READ or err != 0:
+            raise RuntimeError(f"trace read refused, err {err}")
+
+        next_seq, hz, chunk = parse_dump(body[:length])
+        if chunk and chunk[0][0] != seq:
+            print(f"# {chunk[0][0] - seq} records overwritten", file=sys.stderr)
+        records += chunk
+        if not chunk or chunk[-1][0] + 1 >= next_seq:
+            return hz, records
+        seq = chunk[-1][0] + 1
+
+
+def print_timeline(hz, records):
+    if not records:
+        print("trace empty")
+        return
+    # cycle counter wraps, so accumulate per record deltas
+    t, prev = 0.0, records[0][1]
+    for seq, cycles, event, a0, a1, a2 in records:
+        dt = ((cycles - prev) & 0xFFFFFFFF) * 1e6 / hz
+        t += dt
+        prev = cycles
+        name, fmt = EVENTS.get(event, (f"EVENT_{event}", "{a0} {a1} {a2}"))
+        a0s = a0 - 0x10000 if a0 & 0x8000 else a0
+        print(f"{seq:8d} {t:14.1f} us  +{dt:10.1f}  {name:16s} "
+              + fmt.format(a0=a0, a0s=a0s, a1=a1, a2=a2))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="decode the bootloader event trace")
+    parser.add_argument("source", help="serial port, or a raw TRACE_READ response payload with --file")
+    parser.add_argument("--file", action="store_true", help="source is a dump file")
+    parser.add_argument("--baud", type=int, default=115200)
+    args = parser.parse_args()
+
+    if args.file:
+        with open(args.source, "rb") as f:
+            _, hz, records = parse_dump(f.read())
+    else:
+        hz, records = read_serial(args.source, args.baud)
+    print_timeline(hz, records)
+
+
+if __name__ == "__main__":
+    main()